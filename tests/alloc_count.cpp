@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2021 Shawn Wagner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Preloaded into a program with LD_PRELOAD, counts its heap
+// allocations and prints the total to standard error when it exits.
+// operator new, ICU's uprv_malloc() and everything else end up in
+// malloc(), calloc() or realloc(). Used by usplit_alloc.sh.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+
+extern "C" {
+void *__libc_malloc(std::size_t);
+void *__libc_calloc(std::size_t, std::size_t);
+void *__libc_realloc(void *, std::size_t);
+}
+
+namespace {
+std::atomic<unsigned long> allocations;
+
+__attribute__((destructor)) void report() {
+  std::fprintf(stderr, "allocations %lu\n", allocations.load());
+}
+} // namespace
+
+extern "C" {
+void *malloc(std::size_t size) {
+  allocations += 1;
+  return __libc_malloc(size);
+}
+
+void *calloc(std::size_t n, std::size_t size) {
+  allocations += 1;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, std::size_t size) {
+  allocations += 1;
+  return __libc_realloc(p, size);
+}
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2021 Shawn Wagner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Preloaded into a program with LD_PRELOAD, counts its I/O system
+// calls and prints the totals to standard error when it exits. Used by
+// unorm_bench.sh.
+
+#include <atomic>
+#include <cstdio>
+
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+namespace {
+std::atomic<unsigned long> reads, writes, writevs, sendfiles, polls;
+
+template <class F> F next(const char *name) {
+  return reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+}
+
+__attribute__((destructor)) void report() {
+  std::fprintf(stderr, "read %lu write %lu writev %lu sendfile %lu poll %lu\n",
+               reads.load(), writes.load(), writevs.load(), sendfiles.load(),
+               polls.load());
+}
+} // namespace
+
+extern "C" {
+ssize_t read(int fd, void *buf, std::size_t count) {
+  static auto real = next<ssize_t (*)(int, void *, std::size_t)>("read");
+  reads += 1;
+  return real(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, std::size_t count) {
+  static auto real =
+      next<ssize_t (*)(int, const void *, std::size_t)>("write");
+  writes += 1;
+  return real(fd, buf, count);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  static auto real =
+      next<ssize_t (*)(int, const struct iovec *, int)>("writev");
+  writevs += 1;
+  return real(fd, iov, iovcnt);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, std::size_t count) {
+  static auto real =
+      next<ssize_t (*)(int, int, off_t *, std::size_t)>("sendfile");
+  sendfiles += 1;
+  return real(out_fd, in_fd, offset, count);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  static auto real = next<int (*)(struct pollfd *, nfds_t, int)>("poll");
+  polls += 1;
+  return real(fds, nfds, timeout);
+}
+}
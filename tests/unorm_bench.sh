@@ -0,0 +1,34 @@
+#!/bin/sh
+# Pipes generated text through one or more unorm binaries, for example
+# builds from before and after a change, and prints how many I/O system
+# calls each makes per megabyte of input and how fast it runs.
+#
+# Usage: unorm_bench.sh SYSCALL_COUNT.so UNORM...
+
+set -e
+counter=$1
+shift
+megs=64
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Mostly ASCII with some precomposed and decomposed accented letters,
+# in lines of varying length.
+text=$(printf '%s\n%s' \
+  'Ünïcödé text, with a résumé and a café (cafe\314\201) or two.' \
+  'A longer line of plain ASCII text that is already in every normal form.')
+yes "$(printf '%b' "$text")" | head -c $((megs * 1024 * 1024)) >"$tmp/input"
+
+printf '%-30s %8s %8s %8s %8s %8s %8s\n' unorm 'MB/s' read write writev \
+  sendfile poll
+for unorm in "$@"; do
+  # The input is piped in, so it's read rather than mapped.
+  start=$(date +%s%N)
+  cat "$tmp/input" | LD_PRELOAD=$counter "$unorm" --nfc 2>"$tmp/count" |
+    cat >/dev/null
+  end=$(date +%s%N)
+  awk -v name="$unorm" -v megs=$megs -v ns=$((end - start)) '
+    { printf "%-30s %8.1f", name, megs / (ns / 1e9)
+      for (i = 2; i <= NF; i += 2) printf " %8.2f", $i / megs
+      printf "\n" }' "$tmp/count"
+done
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Checks that usplit doesn't allocate memory for each token: splitting
+# ten times as much text may only take a few more allocations, for
+# buffers growing to fit longer paragraphs and the like, not one more
+# per token.
+#
+# Usage: usplit_alloc.sh ALLOC_COUNT.so USPLIT
+
+set -e
+counter=$1
+usplit=$2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+# No Chinese, Japanese or Thai: ICU's dictionary break engines
+# allocate for every run of text they look up, whatever usplit does.
+text=$(printf '%s\n%s\n' \
+  'Ünïcödé text, with a résumé and a café (cafe\314\201) or two. 42 more!' \
+  'Lines of a paragraph, then a blank line. Ελληνικά και русский.')
+printf '%b\n' "$text" >"$tmp/para"
+: >"$tmp/small"
+i=0
+while [ $i -lt 200 ]; do
+  cat "$tmp/para" >>"$tmp/small"
+  i=$((i + 1))
+done
+i=0
+while [ $i -lt 10 ]; do
+  cat "$tmp/small" >>"$tmp/large"
+  i=$((i + 1))
+done
+
+# Prints the number of allocations made splitting a file.
+allocs() {
+  LD_PRELOAD=$counter "$usplit" "$@" 2>&1 >/dev/null |
+    sed -n 's/^allocations //p'
+}
+
+for mode in --codepoints --chars --words --sentences; do
+  for opts in "" --json --offsets=text; do
+    small=$(allocs $mode $opts "$tmp/small")
+    large=$(allocs $mode $opts "$tmp/large")
+    tokens=$("$usplit" $mode "$tmp/small" | wc -l)
+    # Fewer than one more allocation per hundred more tokens.
+    if [ $((large - small)) -gt $((tokens * 9 / 100)) ]; then
+      echo "usplit $mode $opts: $small allocations for $tokens tokens," \
+        "$large for ten times as many" >&2
+      fail=1
+    fi
+  done
+done
+
+exit $fail
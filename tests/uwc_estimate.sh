@@ -0,0 +1,63 @@
+#!/bin/sh
+# Checks that uwc --estimate's confidence intervals cover the exact
+# counts about as often as they claim to: at 95% confidence, at least
+# 32 of 40 estimates of each count of a generated file (whose last
+# 64KiB block is a partial one) must contain the real count.
+#
+# Usage: uwc_estimate.sh UWC
+
+set -e
+uwc=$1
+runs=40
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Runs of lines of English, Japanese, combining marks and long Latin
+# lines, so that blocks differ in how many lines, words and characters
+# they have per byte.
+awk -v size=12345678 'BEGIN {
+  srand(7)
+  p[0] = "The quick brown fox jumps over the lazy dog, again and again."
+  p[1] = "日本語の文章には単語の間に空白がありません。漢字と仮名が混ざっています。"
+  p[2] = "e\314\201 a\314\210\314\201 x y z 1 2 3"
+  p[3] = "Lorem ipsum dolor sit amet consectetur adipiscing elit sed do" \
+         " eiusmod tempor incididunt ut labore et dolore magna aliqua"
+  total = 0
+  while (total < size) {
+    k = int(rand() * 4)
+    n = int(rand() * 3000) + 1
+    for (i = 0; i < n && total < size; i++) {
+      line = p[k]
+      for (r = int(rand() * 4); r > 0; r--)
+        line = line " " p[k]
+      print line
+      total += length(line) + 1
+    }
+  }
+}' >"$tmp/input"
+
+exact=$("$uwc" -l -w -m -c "$tmp/input" | cut -f1-4)
+i=0
+while [ $i -lt $runs ]; do
+  "$uwc" -l -w -m -c --estimate=0.95 "$tmp/input" | cut -f1-4
+  i=$((i + 1))
+done >"$tmp/estimates"
+
+awk -v exact="$exact" -v runs=$runs '
+  BEGIN { split(exact, count, "\t"); split("lines words chars bytes", name) }
+  { for (k = 1; k <= 4; k++) {
+      split($k, e, "±")
+      if (e[1] - e[2] <= count[k] && count[k] <= e[1] + e[2])
+        covered[k]++
+    } }
+  END {
+    fail = NR != runs
+    for (k = 1; k <= 4; k++) {
+      if (covered[k] < runs * 4 / 5) {
+        printf "uwc --estimate: %d of %d intervals cover the %s (%d)\n",
+          covered[k], NR, name[k], count[k] > "/dev/stderr"
+        fail = 1
+      }
+    }
+    exit fail
+  }' FS='\t' "$tmp/estimates"
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Count generated input too big for 32-bit counters and for ICU's
+# 32-bit string lengths. It's streamed through a pipe, so nothing is
+# written to disk.
+#
+# Usage: uwc_large.sh UWC
+
+set -e
+uwc=$1
+line='one two three'
+fail=0
+
+check() {
+  if [ "$2" != "$3" ]; then
+    echo "$1: expected '$3', got '$2'" >&2
+    fail=1
+  fi
+}
+
+# Over 4GiB of codepoints, in 14 byte lines of 3 words.
+lines=330000000
+got=$(yes "$line" | head -n $lines | "$uwc" -l -c)
+check "4GiB of lines" "$got" "$(printf '%s\t%s' $lines $((lines * 14)))"
+
+# One line of more than 2^31 codepoints.
+bytes=2200000000
+rest=$(printf '%s ' "$line" | head -c $((bytes % 14)) | wc -w)
+words=$((bytes / 14 * 3 + rest))
+got=$(yes "$line" | tr '\n' ' ' | head -c $bytes | "$uwc" -w -c -L)
+check "2GiB line" "$got" "$(printf '%s\t%s\t%s' $words $bytes $bytes)"
+
+exit $fail
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Checks that uwc counts text with NULs in it the same whether it reads
+# a small file, which it counts in a batch with others, or standard
+# input, which it counts a line at a time.
+#
+# Usage: uwc_nul.sh UWC
+
+set -e
+uwc=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+printf 'ab\0cd ef\n' >"$tmp/one"
+printf '\0\0\n\0 word\0 \0\nlast line\0 no newline' >"$tmp/lines"
+printf 'Ünïcödé\0cafe\314\201 \0\n\0\n' >"$tmp/accents"
+
+for f in one lines accents; do
+  batched=$("$uwc" -l -w -m -c -L "$tmp/$f" | cut -f1-5)
+  piped=$("$uwc" -l -w -m -c -L <"$tmp/$f")
+  if [ "$batched" != "$piped" ]; then
+    echo "uwc $f: $batched from the file, $piped from standard input" >&2
+    fail=1
+  fi
+done
+
+exit $fail
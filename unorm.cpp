@@ -22,50 +22,974 @@
  */
 
 #include <iostream>
-#include <fstream>
+#include <iomanip>
 #include <string>
 #include <memory>
 #include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 
+#include "json.hpp"
+
 #include <unicode/normalizer2.h>
 #include <unicode/stringpiece.h>
 #include <unicode/bytestream.h>
+#include <unicode/utf8.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 const char *version = "1.0";
 
 using namespace std::literals::string_literals;
 
+// Buffers output and writes it in whole multiples of the buffer
+// size. ICU writes normalized text straight into the buffer through
+// GetAppendBuffer(). Flush() is called by ICU after every
+// normalizeUTF8() call and doesn't write anything; call write_out() at
+// the end instead, or whenever the input stops to wait for more so
+// what's been normalized so far isn't held back.
+//
+// While a mapped input file is registered with map_input(), text
+// appended from inside the mapping isn't copied; it's queued as a
+// pointer into the mapping alongside the buffered text, and all of it
+// goes out with writev().
 class output_bytesink : public icu::ByteSink {
 private:
   int fd;
+  std::unique_ptr<char[]> buf;
+  std::size_t used;
+  std::size_t run_start; // Start of the buffered text not yet in iov
+  std::vector<struct iovec> iov;
+  const char *map_begin;
+  const char *map_end;
+  void write_all(const char *, std::size_t);
+  void writev_all(struct iovec *, std::size_t);
+  void end_run();
 
 public:
-  output_bytesink(int fd_) : fd(fd_) {}
-  ~output_bytesink() noexcept override {}
+  static constexpr std::size_t capacity = 1024 * 1024;
+  // Spans of the mapping shorter than this are copied anyway.
+  static constexpr std::size_t min_gather = 256;
+  output_bytesink(int fd_)
+      : fd(fd_), buf(new char[capacity]), used(0), run_start(0),
+        map_begin(nullptr), map_end(nullptr) {}
+  ~output_bytesink() noexcept override;
   void Append(const char *, int32_t) override;
+  char *GetAppendBuffer(int32_t min_capacity, int32_t,
+                        char *scratch, int32_t scratch_capacity,
+                        int32_t *result_capacity) override;
+  void Flush() override {}
+  void write_out();
+  void map_input(const char *, std::size_t);
+  std::size_t send_file(int, off_t, std::size_t);
 };
 
-void output_bytesink::Append(const char *bytes, int32_t len) {
-  ssize_t out;
-  while ((out = write(fd, bytes, len)) >= 0 && out < len) {
+output_bytesink::~output_bytesink() noexcept {
+  try {
+    write_out();
+  } catch (std::exception &) {
+  }
+}
+
+void output_bytesink::write_all(const char *bytes, std::size_t len) {
+  while (len > 0) {
+    ssize_t out = write(fd, bytes, len);
+    if (out < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"Unable to write to standard output: "s +
+                               std::strerror(errno)};
+    }
     bytes += out;
     len -= out;
   }
-  if (out < 0) {
-    throw std::runtime_error{"Unable to write to standard output: "s +
-                             std::strerror(errno)};
+}
+
+void output_bytesink::writev_all(struct iovec *vec, std::size_t count) {
+  while (count > 0) {
+    ssize_t out = writev(fd, vec, std::min<std::size_t>(count, IOV_MAX));
+    if (out < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"Unable to write to standard output: "s +
+                               std::strerror(errno)};
+    }
+    std::size_t n = out;
+    while (count > 0 && n >= vec->iov_len) {
+      n -= vec->iov_len;
+      vec += 1;
+      count -= 1;
+    }
+    if (n > 0) {
+      vec->iov_base = static_cast<char *>(vec->iov_base) + n;
+      vec->iov_len -= n;
+    }
+  }
+}
+
+// Queue the buffered text that isn't in the iovec list yet.
+void output_bytesink::end_run() {
+  if (used > run_start) {
+    iov.push_back({buf.get() + run_start, used - run_start});
+    run_start = used;
+  }
+}
+
+void output_bytesink::write_out() {
+  if (iov.empty()) {
+    std::size_t len = used;
+    used = run_start = 0;
+    write_all(buf.get(), len);
+    return;
+  }
+  end_run();
+  std::vector<struct iovec> pending;
+  pending.swap(iov);
+  used = run_start = 0;
+  writev_all(pending.data(), pending.size());
+}
+
+// Register the mapped input file that text is appended from, or none
+// with a null pointer. Anything queued from the previous mapping is
+// written first, so this has to be called before it's unmapped.
+void output_bytesink::map_input(const char *begin, std::size_t len) {
+  bool queued = map_begin;
+  map_begin = begin;
+  map_end = begin ? begin + len : nullptr;
+  if (queued) {
+    write_out();
+  }
+}
+
+// Copy part of a file straight to the output inside the kernel, with
+// copy_file_range() or sendfile(). Returns how many bytes were sent,
+// which is less than len if the kernel can't do it for these files; the
+// caller has to write the rest itself.
+std::size_t output_bytesink::send_file(int in_fd, off_t offset,
+                                       std::size_t len) {
+  write_out();
+
+  std::size_t sent = 0;
+  bool use_sendfile = false;
+  while (sent < len) {
+    ssize_t n;
+    if (!use_sendfile) {
+      n = copy_file_range(in_fd, &offset, fd, nullptr, len - sent, 0);
+      if (n < 0 && errno != EINTR) {
+        use_sendfile = true;
+        continue;
+      }
+    } else {
+      n = sendfile(fd, in_fd, &offset, len - sent);
+      if (n < 0 && errno != EINTR) {
+        if (errno == EINVAL || errno == ENOSYS || errno == EBADF ||
+            errno == EOVERFLOW) {
+          break;
+        }
+        throw std::runtime_error{"Unable to write to standard output: "s +
+                                 std::strerror(errno)};
+      }
+    }
+    if (n == 0) {
+      break;
+    } else if (n > 0) {
+      sent += n;
+    }
+  }
+  return sent;
+}
+
+void output_bytesink::Append(const char *bytes, int32_t len) {
+  if (bytes == buf.get() + used) {
+    // Written in place into the buffer from GetAppendBuffer().
+    used += len;
+    if (used == capacity) {
+      write_out();
+    }
+    return;
+  }
+
+  std::size_t n = len;
+  if (n >= min_gather && bytes >= map_begin && bytes + n <= map_end) {
+    end_run();
+    if (!iov.empty() &&
+        static_cast<char *>(iov.back().iov_base) + iov.back().iov_len ==
+            bytes) {
+      iov.back().iov_len += n;
+    } else {
+      iov.push_back({const_cast<char *>(bytes), n});
+    }
+    if (iov.size() >= IOV_MAX) {
+      write_out();
+    }
+    return;
+  }
+
+  while (n > 0) {
+    if (used == 0 && iov.empty() && n >= capacity) {
+      std::size_t direct = n - n % capacity;
+      write_all(bytes, direct);
+      bytes += direct;
+      n -= direct;
+      continue;
+    }
+    std::size_t k = std::min(n, capacity - used);
+    std::memcpy(buf.get() + used, bytes, k);
+    used += k;
+    bytes += k;
+    n -= k;
+    if (used == capacity) {
+      write_out();
+    }
+  }
+}
+
+char *output_bytesink::GetAppendBuffer(int32_t min_capacity, int32_t,
+                                       char *scratch, int32_t scratch_capacity,
+                                       int32_t *result_capacity) {
+  if (min_capacity < 1 || static_cast<std::size_t>(min_capacity) > capacity) {
+    if (min_capacity < 1 || scratch_capacity < min_capacity) {
+      *result_capacity = 0;
+      return nullptr;
+    }
+    *result_capacity = scratch_capacity;
+    return scratch;
+  }
+  if (capacity - used < static_cast<std::size_t>(min_capacity)) {
+    write_out();
+  }
+  *result_capacity = capacity - used;
+  return buf.get() + used;
+}
+
+// Number of bytes at the start of s that are ASCII.
+std::size_t ascii_span(const char *s, std::size_t len) {
+  std::size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    int mask = _mm_movemask_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#else
+  for (; i + 8 <= len; i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, s + i, 8);
+    if (word & 0x8080808080808080ULL) {
+      break;
+    }
+  }
+#endif
+  while (i < len && !(s[i] & 0x80)) {
+    i += 1;
+  }
+  return i;
+}
+
+// Per-codepoint quick check properties of a normalization form, looked
+// up lazily and cached. Safe to share between threads.
+class qc_table {
+private:
+  const icu::Normalizer2 *method;
+  std::unique_ptr<std::atomic<std::uint16_t>[]> table;
+  bool ascii_yes;
+  std::uint16_t compute(UChar32);
+
+public:
+  enum : std::uint16_t {
+    CCC = 0xFF,        // Canonical combining class
+    YES = 0x100,       // Quick check result is yes
+    BOUNDARY = 0x200,  // Always a normalization boundary before it
+    KNOWN = 0x400
+  };
+  explicit qc_table(const icu::Normalizer2 *);
+  const icu::Normalizer2 *normalizer() const noexcept { return method; }
+  // True if every ASCII character is unchanged by normalization and
+  // starts a new segment.
+  bool ascii_is_yes() const noexcept { return ascii_yes; }
+  std::uint16_t operator[](UChar32 c) {
+    auto e = table[c].load(std::memory_order_relaxed);
+    if (!e) {
+      e = compute(c);
+      table[c].store(e, std::memory_order_relaxed);
+    }
+    return e;
+  }
+};
+
+qc_table::qc_table(const icu::Normalizer2 *method_)
+    : method(method_), table(new std::atomic<std::uint16_t>[0x110000]()),
+      ascii_yes(true) {
+  for (UChar32 c = 0; c < 0x80; c += 1) {
+    if (((*this)[c] & (YES | BOUNDARY)) != (YES | BOUNDARY)) {
+      ascii_yes = false;
+    }
+  }
+}
+
+std::uint16_t qc_table::compute(UChar32 c) {
+  UErrorCode err = U_ZERO_ERROR;
+  std::uint16_t e = KNOWN | method->getCombiningClass(c);
+  if (method->quickCheck(icu::UnicodeString(c), err) == UNORM_YES) {
+    e |= YES;
+  }
+  if (method->hasBoundaryBefore(c)) {
+    e |= BOUNDARY;
+  }
+  return e;
+}
+
+// True if the UTF-8 character at the start of s has a normalization
+// boundary before it.
+bool starts_segment(const char *s, std::size_t len, qc_table &qc) {
+  UChar32 c;
+  int32_t clen = 0;
+  U8_NEXT(reinterpret_cast<const std::uint8_t *>(s), clen,
+          static_cast<int32_t>(std::min<std::size_t>(len, U8_MAX_LENGTH)), c);
+  return c >= 0 && (qc[c] & qc_table::BOUNDARY);
+}
+
+// True if the UTF-8 character at the end of s has a normalization
+// boundary after it, so nothing that follows can change it.
+bool ends_segment(const char *s, std::size_t len, qc_table &qc) {
+  const std::size_t start = len - std::min<std::size_t>(len, U8_MAX_LENGTH);
+  int32_t i = len - start;
+  UChar32 c;
+  if (i == 0) {
+    return false;
+  }
+  U8_PREV(reinterpret_cast<const std::uint8_t *>(s + start), 0, i, c);
+  return c >= 0 && qc.normalizer()->hasBoundaryAfter(c);
+}
+
+// Several normalization forms checked together in one pass. A position
+// is a boundary for the set if it's one for every form in it.
+struct form_set {
+  std::vector<qc_table *> forms;
+  std::vector<const char *> names;
+};
+
+bool starts_segment(const char *s, std::size_t len, form_set &fs) {
+  for (qc_table *qc : fs.forms) {
+    if (!starts_segment(s, len, *qc)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ends_segment(const char *s, std::size_t len, form_set &fs) {
+  for (qc_table *qc : fs.forms) {
+    if (!ends_segment(s, len, *qc)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Scan forward from pos for the first character that might not be in
+// normal form, following the quick check algorithm of UAX #15. Returns
+// false if there isn't one. Otherwise everything before seg_start is
+// known to be normalized, and [seg_start, seg_end) is the segment
+// between two normalization boundaries that needs a closer look.
+bool find_unnormalized(const char *s, std::size_t len, std::size_t pos,
+                       qc_table &qc, std::size_t &seg_start,
+                       std::size_t &seg_end) {
+  std::size_t boundary = pos;
+  std::uint8_t prev_ccc = 0;
+  std::size_t i = pos;
+
+  while (i < len) {
+    if (qc.ascii_is_yes()) {
+      std::size_t n = ascii_span(s + i, len - i);
+      if (n > 0) {
+        i += n;
+        boundary = i - 1;
+        prev_ccc = 0;
+        continue;
+      }
+    }
+
+    UChar32 c;
+    int32_t clen = 0;
+    U8_NEXT(reinterpret_cast<const std::uint8_t *>(s + i), clen,
+            static_cast<int32_t>(std::min<std::size_t>(len - i, U8_MAX_LENGTH)),
+            c);
+    std::uint16_t e = c < 0 ? 0 : qc[c];
+    std::uint8_t ccc = e & qc_table::CCC;
+    if (e & qc_table::BOUNDARY) {
+      boundary = i;
+    }
+    if (!(e & qc_table::YES) || (ccc != 0 && prev_ccc > ccc)) {
+      break;
+    }
+    prev_ccc = ccc;
+    i += clen;
+  }
+
+  if (i >= len) {
+    return false;
+  }
+
+  seg_start = boundary;
+  seg_end = i;
+  do {
+    UChar32 c;
+    int32_t clen = 0;
+    U8_NEXT(reinterpret_cast<const std::uint8_t *>(s + seg_end), clen,
+            static_cast<int32_t>(
+                std::min<std::size_t>(len - seg_end, U8_MAX_LENGTH)),
+            c);
+    seg_end += clen;
+  } while (seg_end < len && !starts_segment(s + seg_end, len - seg_end, qc));
+  return true;
+}
+
+// Append a block of any length to a sink.
+void append_bytes(icu::ByteSink &bs, const char *bytes, std::size_t len) {
+  while (len > 0) {
+    auto n = static_cast<int32_t>(
+        std::min<std::size_t>(len, std::numeric_limits<int32_t>::max()));
+    bs.Append(bytes, n);
+    bytes += n;
+    len -= n;
+  }
+}
+
+icu::StringPiece make_piece(const char *s, std::size_t len) {
+  if (len > static_cast<std::size_t>(std::numeric_limits<int32_t>::max())) {
+    throw std::runtime_error{"Normalization segment too long"};
+  }
+  return icu::StringPiece(s, static_cast<int32_t>(len));
+}
+
+// What to do with ill-formed UTF-8.
+enum class on_invalid {
+  KEEP,    // Copy it as it is
+  FAIL,    // Stop with an error
+  REPLACE, // Replace each ill-formed sequence with U+FFFD
+  SKIP     // Leave it out
+};
+
+// Thrown for ill-formed UTF-8 with on_invalid::FAIL.
+class invalid_utf8 : public std::runtime_error {
+public:
+  std::size_t offset; // Byte offset in the file
+  explicit invalid_utf8(std::size_t offset_)
+      : std::runtime_error{"Invalid UTF-8 at byte offset " +
+                           std::to_string(offset_)},
+        offset(offset_) {}
+};
+
+// The offset of the first ill-formed sequence in UTF-8 text, or len if
+// there isn't one.
+std::size_t find_invalid(const char *s, std::size_t len) {
+  for (std::size_t i = 0; i < len;) {
+    UChar32 c;
+    int32_t clen = 0;
+    U8_NEXT(reinterpret_cast<const std::uint8_t *>(s + i), clen,
+            static_cast<int32_t>(std::min<std::size_t>(len - i, U8_MAX_LENGTH)),
+            c);
+    if (c < 0) {
+      return i;
+    }
+    i += clen;
+  }
+  return len;
+}
+
+// Deal with the ill-formed sequences in a segment, the first of which
+// is at bad. offset is where the segment starts in the file. Each
+// maximal ill-formed subsequence is replaced by U+FFFD or dropped.
+std::string repair_segment(const char *s, std::size_t len, std::size_t bad,
+                           on_invalid mode, std::size_t offset) {
+  if (mode == on_invalid::FAIL) {
+    throw invalid_utf8{offset + bad};
+  }
+  std::string fixed{s, bad};
+  for (std::size_t i = bad; i < len;) {
+    UChar32 c;
+    int32_t clen = 0;
+    U8_NEXT(reinterpret_cast<const std::uint8_t *>(s + i), clen,
+            static_cast<int32_t>(std::min<std::size_t>(len - i, U8_MAX_LENGTH)),
+            c);
+    if (c >= 0) {
+      fixed.append(s + i, clen);
+    } else if (mode == on_invalid::REPLACE) {
+      fixed.append("\xEF\xBF\xBD");
+    }
+    i += clen;
   }
+  return fixed;
 }
 
+// Normalize UTF-8 text that starts and ends at normalization
+// boundaries. Runs that pass the quick check are copied to the sink as
+// they are; only the segments around characters that don't are passed
+// through the normalizer. Ill-formed UTF-8 never passes the quick check,
+// so it's only looked for in those segments. offset is where the text
+// starts in the file.
+void normalize_spans(const char *s, std::size_t len, qc_table &qc,
+                     icu::ByteSink &bs, on_invalid mode = on_invalid::KEEP,
+                     std::size_t offset = 0) {
+  std::size_t pos = 0, start, end;
+  UErrorCode err = U_ZERO_ERROR;
+
+  while (find_unnormalized(s, len, pos, qc, start, end)) {
+    append_bytes(bs, s + pos, start - pos);
+    icu::StringPiece segment = make_piece(s + start, end - start);
+    std::string fixed;
+    if (mode != on_invalid::KEEP) {
+      std::size_t bad = find_invalid(s + start, end - start);
+      if (bad < end - start) {
+        fixed = repair_segment(s + start, end - start, bad, mode,
+                               offset + start);
+        segment = make_piece(fixed.data(), fixed.size());
+      }
+    }
+    qc.normalizer()->normalizeUTF8(0, segment, bs, nullptr, err);
+    if (U_FAILURE(err)) {
+      throw std::runtime_error{"Unable to normalize text: "s +
+                               u_errorName(err)};
+    }
+    pos = end;
+  }
+  append_bytes(bs, s + pos, len - pos);
+}
+
+// The length of the longest prefix of UTF-8 text that is known to be
+// normalized and ends at a normalization boundary. This is len if all
+// of it is normalized. Unless ill-formed UTF-8 is kept as it is, a
+// segment with any isn't normalized. offset is where the text starts
+// in the file.
+std::size_t normalized_prefix(const char *s, std::size_t len, qc_table &qc,
+                              on_invalid mode = on_invalid::KEEP,
+                              std::size_t offset = 0) {
+  std::size_t pos = 0, start, end;
+  UErrorCode err = U_ZERO_ERROR;
+
+  while (find_unnormalized(s, len, pos, qc, start, end)) {
+    if (mode != on_invalid::KEEP) {
+      std::size_t bad = find_invalid(s + start, end - start);
+      if (bad < end - start) {
+        if (mode == on_invalid::FAIL) {
+          throw invalid_utf8{offset + start + bad};
+        }
+        return start;
+      }
+    }
+    if (!qc.normalizer()->isNormalizedUTF8(make_piece(s + start, end - start),
+                                           err)) {
+      return start;
+    }
+    if (U_FAILURE(err)) {
+      throw std::runtime_error{"Unable to normalize text: "s +
+                               u_errorName(err)};
+    }
+    pos = end;
+  }
+  return len;
+}
+
+// Decode the escapes in the contents of a JSON string literal. Returns
+// false if there's a bad escape, or one for a lone surrogate, which
+// can't be represented in UTF-8.
+bool json_unescape(const char *s, std::size_t len, std::string &out) {
+  auto hex4 = [&](std::size_t i, UChar32 &c) {
+    if (i + 4 > len) {
+      return false;
+    }
+    c = 0;
+    for (std::size_t n = i; n < i + 4; n += 1) {
+      int d;
+      if (s[n] >= '0' && s[n] <= '9') {
+        d = s[n] - '0';
+      } else if (s[n] >= 'a' && s[n] <= 'f') {
+        d = s[n] - 'a' + 10;
+      } else if (s[n] >= 'A' && s[n] <= 'F') {
+        d = s[n] - 'A' + 10;
+      } else {
+        return false;
+      }
+      c = c * 16 + d;
+    }
+    return true;
+  };
+
+  out.clear();
+  out.reserve(len);
+  for (std::size_t i = 0; i < len; i += 1) {
+    if (s[i] != '\\') {
+      out.push_back(s[i]);
+      continue;
+    }
+    if (++i == len) {
+      return false;
+    }
+    UChar32 c;
+    switch (s[i]) {
+    case '"':
+    case '\\':
+    case '/':
+      out.push_back(s[i]);
+      continue;
+    case 'b':
+      out.push_back('\b');
+      continue;
+    case 'f':
+      out.push_back('\f');
+      continue;
+    case 'n':
+      out.push_back('\n');
+      continue;
+    case 'r':
+      out.push_back('\r');
+      continue;
+    case 't':
+      out.push_back('\t');
+      continue;
+    case 'u':
+      if (!hex4(i + 1, c)) {
+        return false;
+      }
+      i += 4;
+      if (U16_IS_LEAD(c)) {
+        UChar32 trail;
+        if (i + 2 >= len || s[i + 1] != '\\' || s[i + 2] != 'u' ||
+            !hex4(i + 3, trail) || !U16_IS_TRAIL(trail)) {
+          return false;
+        }
+        c = U16_GET_SUPPLEMENTARY(c, trail);
+        i += 6;
+      } else if (U16_IS_TRAIL(c)) {
+        return false;
+      }
+      break;
+    default:
+      return false;
+    }
+    char utf8[U8_MAX_LENGTH];
+    int32_t n = 0;
+    U8_APPEND_UNSAFE(utf8, n, c);
+    out.append(utf8, n);
+  }
+  return true;
+}
+
+// Write text as the contents of a JSON string literal, escaping only
+// what has to be.
+void append_json_escaped(icu::ByteSink &bs, const std::string &text) {
+  static const char hex[] = "0123456789abcdef";
+  std::string escaped;
+  escaped.reserve(text.size() + 16);
+  for (char ch : text) {
+    auto c = static_cast<unsigned char>(ch);
+    switch (c) {
+    case '"':
+      escaped.append("\\\"");
+      break;
+    case '\\':
+      escaped.append("\\\\");
+      break;
+    case '\b':
+      escaped.append("\\b");
+      break;
+    case '\f':
+      escaped.append("\\f");
+      break;
+    case '\n':
+      escaped.append("\\n");
+      break;
+    case '\r':
+      escaped.append("\\r");
+      break;
+    case '\t':
+      escaped.append("\\t");
+      break;
+    default:
+      if (c < 0x20) {
+        escaped.append("\\u00");
+        escaped.push_back(hex[c >> 4]);
+        escaped.push_back(hex[c & 0xF]);
+      } else {
+        escaped.push_back(ch);
+      }
+    }
+  }
+  append_bytes(bs, escaped.data(), escaped.size());
+}
+
+// Normalizes the contents of the string literals in JSON text and
+// copies everything else as it is. The text can be given in pieces
+// split anywhere; a string literal that isn't finished at the end of
+// one is kept until the rest of it arrives. Strings with escapes are
+// decoded to check them, and only rewritten, with just the escapes
+// JSON requires, if they change. The JSON isn't otherwise validated.
+class json_normalizer {
+private:
+  qc_table &qc;
+  icu::ByteSink &bs;
+  on_invalid invalid;
+  bool in_string;
+  bool in_escape;
+  bool has_escapes;
+  bool changed_;
+  std::string pending;
+  std::size_t string_offset;
+  void finish_string(const char *, std::size_t);
+
+public:
+  json_normalizer(qc_table &qc_, icu::ByteSink &bs_, on_invalid invalid_)
+      : qc(qc_), bs(bs_), invalid(invalid_), in_string(false),
+        in_escape(false), has_escapes(false), changed_(false),
+        string_offset(0) {}
+  void process(std::size_t, const char *, std::size_t);
+  void finish();
+  // True if any string was changed.
+  bool changed() const noexcept { return changed_; }
+};
+
+void json_normalizer::process(std::size_t offset, const char *s,
+                              std::size_t len) {
+  std::size_t i = 0;
+  while (i < len) {
+    if (!in_string) {
+      auto quote = static_cast<const char *>(std::memchr(s + i, '"', len - i));
+      if (!quote) {
+        append_bytes(bs, s + i, len - i);
+        return;
+      }
+      std::size_t start = quote - s + 1;
+      append_bytes(bs, s + i, start - i);
+      in_string = true;
+      has_escapes = false;
+      string_offset = offset + start;
+      i = start;
+    }
+
+    std::size_t start = i;
+    for (; i < len; i += 1) {
+      if (in_escape) {
+        in_escape = false;
+      } else if (s[i] == '\\') {
+        in_escape = has_escapes = true;
+      } else if (s[i] == '"') {
+        break;
+      }
+    }
+    if (i == len) {
+      pending.append(s + start, len - start);
+      return;
+    }
+    if (pending.empty()) {
+      finish_string(s + start, i - start);
+    } else {
+      pending.append(s + start, i - start);
+      finish_string(pending.data(), pending.size());
+      pending.clear();
+    }
+    append_bytes(bs, "\"", 1);
+    in_string = false;
+    i += 1;
+  }
+}
+
+void json_normalizer::finish_string(const char *s, std::size_t len) {
+  std::string decoded;
+  const char *text = s;
+  std::size_t text_len = len;
+  if (has_escapes) {
+    if (!json_unescape(s, len, decoded)) {
+      append_bytes(bs, s, len);
+      return;
+    }
+    text = decoded.data();
+    text_len = decoded.size();
+  }
+
+  std::size_t prefix =
+      normalized_prefix(text, text_len, qc, invalid, string_offset);
+  if (prefix == text_len) {
+    append_bytes(bs, s, len);
+    return;
+  }
+
+  std::string out{text, prefix};
+  icu::StringByteSink<std::string> sink(&out);
+  normalize_spans(text + prefix, text_len - prefix, qc, sink, invalid,
+                  string_offset + prefix);
+  append_json_escaped(bs, out);
+  changed_ = true;
+}
+
+// An unfinished string at the end of the input is copied as it is.
+void json_normalizer::finish() {
+  append_bytes(bs, pending.data(), pending.size());
+  pending.clear();
+}
+
+// Normalized chunks handed to the threads of parallel_normalize() are
+// about this big.
+constexpr std::size_t parallel_chunk = 4 * 1024 * 1024;
+
+// The offset of the first normalization boundary at or after pos.
+template <class Table>
+std::size_t next_boundary(const char *s, std::size_t len, std::size_t pos,
+                          Table &qc) {
+  while (pos < len && (U8_IS_TRAIL(s[pos]) ||
+                       !starts_segment(s + pos, len - pos, qc))) {
+    pos += 1;
+  }
+  return pos;
+}
+
+// Normalize a large buffer with several threads. It's cut into chunks
+// at normalization boundaries, each thread normalizes a chunk at a time
+// into its own buffer, and the buffers are written out in order. Since
+// normalization never looks across a boundary, the result is identical
+// to normalizing it all at once. At most two chunks per thread are in
+// memory at a time.
+void parallel_normalize(const char *s, std::size_t len, qc_table &qc,
+                        icu::ByteSink &bs, unsigned int nthreads,
+                        on_invalid mode, std::size_t offset) {
+  std::vector<std::size_t> starts{0};
+  while (starts.back() < len) {
+    starts.push_back(next_boundary(
+        s, len, std::min(len, starts.back() + parallel_chunk), qc));
+  }
+  const std::size_t nchunks = starts.size() - 1;
+  const std::size_t window = 2 * nthreads;
+
+  struct slot {
+    std::string out;
+    bool ready = false;
+  };
+  std::vector<slot> slots(window);
+  std::size_t next_chunk = 0, next_write = 0;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::exception_ptr failure;
+
+  auto fail = [&](std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!failure) {
+      failure = e;
+    }
+    cv.notify_all();
+  };
+
+  auto worker = [&]() {
+    for (;;) {
+      std::size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() {
+          return failure || next_chunk >= nchunks ||
+                 next_chunk < next_write + window;
+        });
+        if (failure || next_chunk >= nchunks) {
+          return;
+        }
+        i = next_chunk++;
+      }
+      std::string out;
+      try {
+        out.reserve(starts[i + 1] - starts[i]);
+        icu::StringByteSink<std::string> sink(&out);
+        normalize_spans(s + starts[i], starts[i + 1] - starts[i], qc, sink,
+                        mode, offset + starts[i]);
+      } catch (...) {
+        fail(std::current_exception());
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      slots[i % window].out.swap(out);
+      slots[i % window].ready = true;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int n = 0; n < std::min<std::size_t>(nthreads, nchunks);
+       n += 1) {
+    threads.emplace_back(worker);
+  }
+
+  try {
+    std::string out;
+    for (std::size_t i = 0; i < nchunks; i += 1) {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() { return failure || slots[i % window].ready; });
+        if (failure) {
+          break;
+        }
+        out.swap(slots[i % window].out);
+        slots[i % window].ready = false;
+      }
+      append_bytes(bs, out.data(), out.size());
+      out.clear();
+      std::lock_guard<std::mutex> lock(mtx);
+      next_write = i + 1;
+      cv.notify_all();
+    }
+  } catch (...) {
+    fail(std::current_exception());
+  }
+
+  for (auto &t : threads) {
+    t.join();
+  }
+  if (failure) {
+    std::rethrow_exception(failure);
+  }
+}
+
+// What --check reports for each file. TABLE and JSON are the forms each
+// file is in, for --all-forms.
+enum class listing { NONE, FAILING, PASSING, TABLE, JSON };
+
+struct norm_options {
+  bool check;
+  bool in_place;
+  bool json;
+  listing list;
+  on_invalid invalid;
+  unsigned int threads;
+  std::size_t window; // Most of a file to map at once
+  norm_options()
+      : check(false), in_place(false), json(false), list(listing::NONE),
+        invalid(on_invalid::KEEP), threads(1),
+        window(256 * 1024 * 1024) {}
+};
+
 class file_wrapper {
 private:
   int fd;
@@ -87,10 +1011,209 @@ public:
   operator int() const noexcept { return fd; }
 };
 
-bool try_mmap_norm(const char *filename, const icu::Normalizer2 *method,
-                   icu::ByteSink &bs, bool check) {
-  file_wrapper fd;
+// The offset of the last normalization boundary in the buffer, or 0 if
+// there isn't one after the start.
+template <class Table>
+std::size_t last_boundary(const char *s, std::size_t len, Table &qc) {
+  for (std::size_t pos = len; pos > 0;) {
+    pos -= 1;
+    if (!U8_IS_TRAIL(s[pos]) && starts_segment(s + pos, len - pos, qc)) {
+      return pos;
+    }
+  }
+  return 0;
+}
+
+// Call f(offset, text, len) on consecutive pieces of a file that start
+// and end at normalization boundaries, by mapping a window of it at a
+// time. Each window is cut at its last normalization boundary, and the
+// next one is mapped starting from the page that boundary is in, so no
+// more than the window size is mapped at once. A window is doubled if
+// it has no boundary. Stops early if f returns false. Returns false if
+// the file can't be mapped, including files that don't report a size,
+// like those in /proc.
+template <class Table, class Callback>
+bool map_windows(int fd, std::size_t window, Table &qc, Callback f) {
+  struct stat s;
+  if (fstat(fd, &s) < 0 || s.st_size <= 0) {
+    return false;
+  }
+
+  const std::size_t size = s.st_size;
+  const std::size_t page = sysconf(_SC_PAGESIZE);
+  std::size_t maplen = 0;
+  window = std::max(window, page);
+
+  auto free_mmap = [&maplen](void *mem) {
+    if (mem != MAP_FAILED) {
+      munmap(mem, maplen);
+    }
+  };
 
+  for (std::size_t pos = 0; pos < size;) {
+    std::size_t base = pos - pos % page;
+    maplen = std::min(window, size - base);
+    std::unique_ptr<void, decltype(free_mmap)> utf8(
+        mmap(nullptr, maplen, PROT_READ, MAP_PRIVATE, fd, base), free_mmap);
+    if (utf8.get() == MAP_FAILED) {
+      if (pos == 0) {
+        return false;
+      }
+      throw std::runtime_error{"Unable to map file: "s + std::strerror(errno)};
+    }
+    madvise(utf8.get(), maplen, MADV_SEQUENTIAL);
+
+    const char *text = static_cast<const char *>(utf8.get()) + (pos - base);
+    std::size_t len = maplen - (pos - base);
+    if (base + maplen < size) {
+      std::size_t safe = last_boundary(text, len, qc);
+      if (safe == 0) {
+        window *= 2;
+        continue;
+      }
+      len = safe;
+    }
+
+    if (!f(pos, text, len)) {
+      break;
+    }
+    pos += len;
+  }
+
+  return true;
+}
+
+// True if a read from fd wouldn't block.
+bool input_ready(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  int n;
+  do {
+    n = poll(&pfd, 1, 0);
+  } while (n < 0 && errno == EINTR);
+  return n != 0;
+}
+
+// Size of the blocks read by read_blocks().
+constexpr std::size_t stream_block = 1024 * 1024;
+
+// Like map_windows(), for input that can't be mapped, like pipes. It's
+// read up to a block at a time. Whatever has been read is passed on as
+// soon as it arrives, up to its last normalization boundary (Or all of
+// it if the last character can't combine with anything after it), and
+// the rest is carried over to the front of the next read, so memory use
+// doesn't depend on line length and a slow pipe isn't held up. The
+// buffer only grows past the block size for input with no boundary in
+// a whole block. idle() is called when text has been passed on and the
+// next read would block.
+template <class Table, class Callback, class Idle>
+void read_blocks(int fd, const char *filename, Table &qc, Callback f,
+                 Idle idle) {
+  std::unique_ptr<char[]> buf{new char[stream_block]};
+  std::size_t capacity = stream_block;
+  std::size_t used = 0;
+  std::size_t offset = 0;
+  // How much of the start of the buffer is known not to have a boundary
+  // after its first character, so it isn't searched again.
+  std::size_t searched = 0;
+  bool passed = false;
+
+  for (;;) {
+    if (passed && !input_ready(fd)) {
+      idle();
+      passed = false;
+    }
+    if (used == capacity) {
+      std::unique_ptr<char[]> bigger{new char[capacity * 2]};
+      std::memcpy(bigger.get(), buf.get(), used);
+      buf = std::move(bigger);
+      capacity *= 2;
+    }
+    ssize_t n = read(fd, buf.get() + used, capacity - used);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"Unable to read from '"s + filename +
+                               "': " + std::strerror(errno)};
+    } else if (n == 0) {
+      break;
+    }
+    used += n;
+
+    std::size_t safe = used;
+    if (!ends_segment(buf.get(), used, qc)) {
+      // A character cut off at the end of the last read might start a
+      // segment now that it's complete.
+      std::size_t from =
+          searched - std::min<std::size_t>(searched, U8_MAX_LENGTH);
+      safe = last_boundary(buf.get() + from, used - from, qc);
+      if (safe == 0) {
+        searched = used;
+        continue;
+      }
+      safe += from;
+    }
+    if (!f(offset, buf.get(), safe)) {
+      return;
+    }
+    passed = true;
+    std::memmove(buf.get(), buf.get() + safe, used - safe);
+    used -= safe;
+    offset += safe;
+    searched = 0;
+  }
+  f(offset, buf.get(), used);
+}
+
+// Registers a mapped input file with an output_bytesink while it's in
+// scope. Unchanged text is written from the mapping, so it has to be
+// flushed before the mapping goes away. Call release() to find out if
+// that fails.
+class input_mapping {
+private:
+  output_bytesink &bs;
+
+public:
+  input_mapping(output_bytesink &bs_, const char *text, std::size_t len)
+      : bs(bs_) {
+    bs.map_input(text, len);
+  }
+  ~input_mapping() noexcept {
+    try {
+      release();
+    } catch (std::exception &) {
+    }
+  }
+  void release() { bs.map_input(nullptr, 0); }
+};
+
+// Normalize part of a mapped file that starts and ends at normalization
+// boundaries. offset is where it starts in the file.
+void norm_mapped(int fd, std::size_t offset, const char *text,
+                 std::size_t len,
+                 qc_table &qc, output_bytesink &bs, const norm_options &opts) {
+  input_mapping mapping(bs, text, len);
+
+  // Whatever is already normalized at the start, often the whole file,
+  // is copied by the kernel instead of through the normalizer.
+  std::size_t prefix = normalized_prefix(text, len, qc, opts.invalid, offset);
+  std::size_t sent = bs.send_file(fd, offset, prefix);
+  append_bytes(bs, text + sent, prefix - sent);
+  text += prefix;
+  len -= prefix;
+  offset += prefix;
+
+  if (opts.threads > 1 && len > parallel_chunk) {
+    parallel_normalize(text, len, qc, bs, opts.threads, opts.invalid, offset);
+  } else {
+    normalize_spans(text, len, qc, bs, opts.invalid, offset);
+  }
+  mapping.release();
+}
+
+// Opens a file for reading, or standard input for "-" or "/dev/stdin".
+// Throws std::invalid_argument if it can't be opened.
+void open_input(const char *filename, file_wrapper &fd) {
   if (std::strcmp(filename, "/dev/stdin") == 0 ||
       std::strcmp(filename, "-") == 0) {
     fd.set(STDIN_FILENO);
@@ -100,91 +1223,461 @@ bool try_mmap_norm(const char *filename, const icu::Normalizer2 *method,
   if (fd < 0) {
     throw std::invalid_argument{filename};
   }
+}
 
-  struct stat s;
-  if (fstat(fd, &s) < 0) {
-    return false;
+// Normalize a file to a sink. Returns false if it's known that nothing
+// was changed, which is only tracked with --json.
+bool do_normalization(const char *filename, qc_table &qc,
+                      output_bytesink &bs, const norm_options &opts) {
+  file_wrapper fd;
+  open_input(filename, fd);
+
+  try {
+    if (opts.json) {
+      json_normalizer jn(qc, bs, opts.invalid);
+      if (!map_windows(
+              fd, opts.window, qc,
+              [&](std::size_t offset, const char *text, std::size_t len) {
+                input_mapping mapping(bs, text, len);
+                jn.process(offset, text, len);
+                mapping.release();
+                return true;
+              })) {
+        read_blocks(
+            fd, filename, qc,
+            [&](std::size_t offset, const char *text, std::size_t len) {
+              jn.process(offset, text, len);
+              return true;
+            },
+            [&] { bs.write_out(); });
+      }
+      jn.finish();
+      return jn.changed();
+    }
+
+    if (!map_windows(
+            fd, opts.window, qc,
+            [&](std::size_t offset, const char *text, std::size_t len) {
+              norm_mapped(fd, offset, text, len, qc, bs, opts);
+              return true;
+            })) {
+      read_blocks(fd, filename, qc,
+                  [&](std::size_t offset, const char *text, std::size_t len) {
+                    normalize_spans(text, len, qc, bs, opts.invalid, offset);
+                    return true;
+                  },
+                  [&] { bs.write_out(); });
+    }
+  } catch (invalid_utf8 &e) {
+    throw std::runtime_error{"Invalid UTF-8 in '"s + filename +
+                             "' at byte offset " + std::to_string(e.offset)};
   }
+  return true;
+}
 
-  auto free_mmap = [&s](void *mem) {
-    if (mem != MAP_FAILED) {
-      munmap(mem, s.st_size);
+constexpr std::size_t normalized = std::numeric_limits<std::size_t>::max();
+
+// Checked text is handed to each form in pieces of about this size,
+// so it's still in cache for the next form.
+constexpr std::size_t check_piece = 64 * 1024;
+
+// For each form of a set, the offset of the start of the first segment
+// of a file that isn't normalized, or normalized if there isn't one.
+// The file is read once for all the forms, and only until every one of
+// them has failed.
+std::vector<std::size_t> first_violations(const char *filename, form_set &fs,
+                                          const norm_options &opts) {
+  file_wrapper fd;
+  open_input(filename, fd);
+
+  std::vector<std::size_t> violations(fs.forms.size(), normalized);
+  std::size_t remaining = fs.forms.size();
+  auto check = [&](std::size_t offset, const char *text, std::size_t len) {
+    for (std::size_t pos = 0; pos < len && remaining > 0;) {
+      std::size_t end =
+          next_boundary(text, len, std::min(len, pos + check_piece), fs);
+      for (std::size_t n = 0; n < fs.forms.size(); n += 1) {
+        if (violations[n] != normalized) {
+          continue;
+        }
+        std::size_t prefix = normalized_prefix(
+            text + pos, end - pos, *fs.forms[n], opts.invalid, offset + pos);
+        if (prefix < end - pos) {
+          violations[n] = offset + pos + prefix;
+          remaining -= 1;
+        }
+      }
+      pos = end;
     }
+    return remaining > 0;
   };
+  try {
+    if (!map_windows(fd, opts.window, fs, check)) {
+      read_blocks(fd, filename, fs, check, [] {});
+    }
+  } catch (invalid_utf8 &e) {
+    throw std::runtime_error{"Invalid UTF-8 in '"s + filename +
+                             "' at byte offset " + std::to_string(e.offset)};
+  }
+  return violations;
+}
 
-  std::unique_ptr<void, decltype(free_mmap)> utf8(
-      mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0), free_mmap);
-  if (utf8.get() == MAP_FAILED) {
-    return false;
+// The exit code for several files is the highest ranked of theirs:
+// an error reading a file (1) over one that can't be opened (3), and
+// any error over a file that isn't normalized (2).
+int status_rank(int status) {
+  switch (status) {
+  case 0:
+    return 0;
+  case 2:
+    return 1;
+  case 3:
+    return 2;
+  default:
+    return 3;
   }
+}
 
-  icu::StringPiece sp(static_cast<char *>(utf8.get()), s.st_size);
-  UErrorCode err = U_ZERO_ERROR;
+// Check files, several at a time with --threads. Without a listing,
+// stops at the first file that isn't normalized. Otherwise lists files
+// that aren't normalized, with the offset of the first segment that
+// isn't, or those that are, or a table of the forms each file is in,
+// in the order given. Returns the exit code.
+int check_files(const char *progname, char **files, int nfiles, form_set &fs,
+                const norm_options &opts) {
+  struct result {
+    bool done = false;
+    std::vector<std::size_t> violations;
+    int status = 0;
+    std::string error;
+  };
+  std::vector<result> results(nfiles);
+  int next_file = 0, next_report = 0;
+  bool failed = false;
+  int exit_code = 0;
+  std::size_t json_records = 0;
+  std::mutex mtx;
 
-  if (check) {
-    if (!method->isNormalizedUTF8(sp, err)) {
-      std::exit(2);
+  if (opts.list == listing::TABLE) {
+    for (const char *name : fs.names) {
+      std::string upper{name};
+      std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+      std::cout << std::left << std::setw(5) << upper;
     }
-  } else {
-    method->normalizeUTF8(0, sp, bs, nullptr, err);
+    std::cout << "FILE\n";
+  } else if (opts.list == listing::JSON) {
+    std::cout << '[';
   }
 
-  if (U_FAILURE(err)) {
-    throw std::runtime_error{"Unable to normalize text: "s + u_errorName(err)};
+  // Called with the lock held.
+  auto report = [&]() {
+    for (; next_report < nfiles && results[next_report].done;
+         next_report += 1) {
+      const result &r = results[next_report];
+      if (r.status == 3) {
+        std::cerr << progname << ": Unable to open '" << files[next_report]
+                  << "' for reading.\n";
+      } else if (r.status == 1) {
+        std::cerr << progname << ": " << r.error << '\n';
+      } else if (opts.list == listing::FAILING && r.status == 2) {
+        std::cout << files[next_report] << ':' << r.violations[0] << '\n';
+      } else if (opts.list == listing::PASSING && r.status == 0) {
+        std::cout << files[next_report] << '\n';
+      } else if (opts.list == listing::TABLE) {
+        for (std::size_t n = 0; n < fs.names.size(); n += 1) {
+          std::cout << std::left << std::setw(5)
+                    << (r.violations[n] == normalized ? "yes" : "no");
+        }
+        std::cout << files[next_report] << '\n';
+      } else if (opts.list == listing::JSON) {
+        nlohmann::json rec;
+        rec["filename"] = files[next_report];
+        for (std::size_t n = 0; n < fs.names.size(); n += 1) {
+          rec[fs.names[n]] = r.violations[n] == normalized;
+        }
+        std::cout << (json_records++ ? ",\n" : "\n") << rec.dump();
+      }
+      if (status_rank(r.status) > status_rank(exit_code)) {
+        exit_code = r.status;
+      }
+    }
+  };
+
+  auto worker = [&]() {
+    for (;;) {
+      int i;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (next_file == nfiles || failed) {
+          return;
+        }
+        i = next_file++;
+      }
+      result r;
+      try {
+        r.violations = first_violations(files[i], fs, opts);
+        if (opts.list != listing::TABLE && opts.list != listing::JSON &&
+            r.violations[0] != normalized) {
+          r.status = 2;
+        }
+      } catch (std::invalid_argument &) {
+        r.status = 3;
+      } catch (std::exception &e) {
+        r.status = 1;
+        r.error = e.what();
+      }
+      r.done = true;
+      std::lock_guard<std::mutex> lock(mtx);
+      if (r.status == 2 && opts.list == listing::NONE) {
+        failed = true;
+      }
+      results[i] = std::move(r);
+      report();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int n = 1; n < std::min<unsigned int>(opts.threads, nfiles);
+       n += 1) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
   }
+  if (opts.list == listing::JSON) {
+    std::cout << (json_records ? "\n]\n" : "]\n");
+  }
+  std::cout.flush();
 
-  return true;
+  // Every file handed to a worker has been reported by now, including
+  // the one that set failed.
+  return exit_code;
 }
 
-bool try_line_norm(const char *filename, const icu::Normalizer2 *method,
-                   icu::ByteSink &bs, bool check) {
-  std::string line;
-  ssize_t len;
-  std::string normalized;
-  UErrorCode err = U_ZERO_ERROR;
-  std::ifstream fstr;
-  bool using_stdin = std::strcmp(filename, "/dev/stdin") == 0 ||
-                     std::strcmp(filename, "-") == 0;
+// Used to make names for temporary files unique between threads.
+std::atomic<unsigned long> temp_counter{0};
 
-  if (!using_stdin) {
-    fstr.open(filename);
-    if (!fstr.is_open()) {
-      throw std::invalid_argument{filename};
+// Normalize a file in place. Nothing is written if it's already
+// normalized. Otherwise the normalized text goes into a new file in the
+// same directory, with the same mode and owner, which then replaces the
+// original with rename(), so the file is never seen half-written. The
+// new file is created with O_TMPFILE where that's supported, so nothing
+// is left behind if this fails partway, and only given a name with
+// linkat() once it's complete. Returns true if the file was changed.
+bool normalize_in_place(const char *filename, qc_table &qc,
+                        const norm_options &opts) {
+  // With --json, whether anything changes is only known after
+  // normalizing it.
+  if (!opts.json) {
+    form_set fs;
+    fs.forms.push_back(&qc);
+    if (first_violations(filename, fs, opts)[0] == normalized) {
+      return false;
     }
   }
-  std::istream &inf = using_stdin ? std::cin : fstr;
 
-  while (std::getline(inf, line)) {
-    line += '\n';
-    icu::StringPiece sp(line.data(), line.size());
-    if (check) {
-      if (!method->isNormalizedUTF8(sp, err)) {
-        std::exit(2);
-      }
-    } else {
-      method->normalizeUTF8(0, sp, bs, nullptr, err);
+  // A symbolic link is followed, and the file it points to is replaced
+  // instead of the link.
+  std::unique_ptr<char, decltype(&std::free)> real{
+      realpath(filename, nullptr), &std::free};
+  struct stat s;
+  if (!real || stat(real.get(), &s) < 0) {
+    throw std::invalid_argument{filename};
+  }
+
+  std::string dir{real.get()}, base{real.get()};
+  auto slash = dir.rfind('/');
+  if (slash == std::string::npos) {
+    dir = ".";
+  } else {
+    base.erase(0, slash + 1);
+    dir.erase(slash == 0 ? 1 : slash);
+  }
+
+  file_wrapper out;
+  std::string tempname;
+  auto remove_temp = [&tempname](file_wrapper *) {
+    if (!tempname.empty()) {
+      unlink(tempname.c_str());
     }
-    if (U_FAILURE(err)) {
-      break;
+  };
+  std::unique_ptr<file_wrapper, decltype(remove_temp)> temp_guard(
+      &out, remove_temp);
+
+  bool anonymous = true;
+  out.set(open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600));
+  if (out < 0) {
+    anonymous = false;
+    std::string pattern = dir + "/." + base + ".XXXXXX";
+    std::vector<char> temp(pattern.begin(), pattern.end());
+    temp.push_back('\0');
+    out.set(mkstemp(temp.data()));
+    if (out < 0) {
+      throw std::runtime_error{"Unable to create a temporary file in '"s +
+                               dir + "': " + std::strerror(errno)};
     }
+    tempname = temp.data();
   }
 
-  if (U_FAILURE(err)) {
-    throw std::runtime_error{"Unable to normalize text: "s + u_errorName(err)};
+  {
+    output_bytesink bs(out);
+    bool changed = do_normalization(filename, qc, bs, opts);
+    bs.write_out();
+    if (!changed) {
+      return false;
+    }
+  }
+
+  // Only root can give the file to someone else; otherwise it stays ours.
+  if (fchown(out, s.st_uid, s.st_gid) < 0) {
+    (void)fchown(out, -1, s.st_gid);
+  }
+  if (fchmod(out, s.st_mode & 07777) < 0) {
+    throw std::runtime_error{"Unable to set permissions of '"s + filename +
+                             "': " + std::strerror(errno)};
+  }
+  // So a crash after the rename can't leave an empty or partly written
+  // file in place of the original.
+  if (fsync(out) < 0) {
+    throw std::runtime_error{"Unable to write to '"s + dir +
+                             "': " + std::strerror(errno)};
+  }
+
+  if (anonymous) {
+    std::string proc = "/proc/self/fd/" + std::to_string(out);
+    for (;;) {
+      std::string name = dir + "/." + base + "." + std::to_string(getpid()) +
+                         "." + std::to_string(temp_counter++);
+      if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, name.c_str(),
+                 AT_SYMLINK_FOLLOW) == 0) {
+        tempname = name;
+        break;
+      }
+      if (errno != EEXIST) {
+        throw std::runtime_error{"Unable to create a file in '"s + dir +
+                                 "': " + std::strerror(errno)};
+      }
+    }
   }
 
+  if (rename(tempname.c_str(), real.get()) < 0) {
+    throw std::runtime_error{"Unable to replace '"s + filename +
+                             "': " + std::strerror(errno)};
+  }
+  tempname.clear();
   return true;
 }
 
-void do_normalization(const char *filename, const icu::Normalizer2 *method,
-                      icu::ByteSink &bs, bool check) {
-  if (try_mmap_norm(filename, method, bs, check)) {
-    return;
+// Normalize files in place, several at a time with --threads. A single
+// file gets all the threads to itself instead. Returns the exit code.
+int in_place_files(const char *progname, char **files, int nfiles,
+                   qc_table &qc, const norm_options &opts) {
+  norm_options file_opts = opts;
+  if (nfiles > 1) {
+    file_opts.threads = 1;
   }
-  if (try_line_norm(filename, method, bs, check)) {
-    return;
+
+  std::atomic<int> next_file{0};
+  int exit_code = 0;
+  std::mutex mtx;
+
+  auto worker = [&]() {
+    for (int i; (i = next_file++) < nfiles;) {
+      try {
+        normalize_in_place(files[i], qc, file_opts);
+      } catch (std::invalid_argument &) {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::cerr << progname << ": Unable to open '" << files[i]
+                  << "' for reading.\n";
+        if (exit_code == 0) {
+          exit_code = 3;
+        }
+      } catch (std::exception &e) {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::cerr << progname << ": " << files[i] << ": " << e.what() << '\n';
+        exit_code = 1;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int n = 1; n < std::min<unsigned int>(opts.threads, nfiles);
+       n += 1) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
   }
-  throw std::runtime_error{"Unable to normalize file '"s + filename + "'"s};
+
+  return exit_code;
+}
+
+// Open a normalizer from custom data built with gennorm2, given as
+// PATH,NAME[,MODE]. PATH is a directory holding NAME.nrm, or an ICU data
+// package without its .dat extension. MODE is compose (the default) or
+// decompose. Returns nullptr if the argument isn't valid.
+const icu::Normalizer2 *custom_normalizer(const char *arg, UErrorCode &err) {
+  std::string path{arg}, name, mode{"compose"};
+  auto comma = path.find(',');
+  if (comma == std::string::npos) {
+    return nullptr;
+  }
+  name = path.substr(comma + 1);
+  path.erase(comma);
+  comma = name.find(',');
+  if (comma != std::string::npos) {
+    mode = name.substr(comma + 1);
+    name.erase(comma);
+  }
+  if (path.empty() || name.empty()) {
+    return nullptr;
+  }
+
+  UNormalization2Mode m;
+  if (mode == "compose") {
+    m = UNORM2_COMPOSE;
+  } else if (mode == "decompose") {
+    m = UNORM2_DECOMPOSE;
+  } else {
+    return nullptr;
+  }
+  return icu::Normalizer2::getInstance(path.c_str(), name.c_str(), m, err);
+}
+
+// Parse a size in bytes with an optional K, M or G suffix. Returns 0 if
+// it's not valid.
+std::size_t parse_size(const char *arg) {
+  char *end;
+  errno = 0;
+  unsigned long long n = std::strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg) {
+    return 0;
+  }
+  int shift = 0;
+  switch (*end) {
+  case 'k':
+  case 'K':
+    shift = 10;
+    end += 1;
+    break;
+  case 'm':
+  case 'M':
+    shift = 20;
+    end += 1;
+    break;
+  case 'g':
+  case 'G':
+    shift = 30;
+    end += 1;
+    break;
+  }
+  if (*end != '\0' ||
+      n > (std::numeric_limits<std::size_t>::max() >> shift)) {
+    return 0;
+  }
+  return static_cast<std::size_t>(n) << shift;
 }
 
 int main(int argc, char **argv) {
@@ -192,23 +1685,92 @@ int main(int argc, char **argv) {
       {"version", 0, nullptr, 'v'}, {"help", 0, nullptr, 'h'},
       {"nfc", 0, nullptr, 1},       {"nfd", 0, nullptr, 2},
       {"nfkc", 0, nullptr, 3},      {"nfkd", 0, nullptr, 4},
-      {"check", 0, nullptr, 'c'},   {nullptr, 0, nullptr, 0}};
+      {"nfkc-cf", 0, nullptr, 7},   {"custom", 1, nullptr, 8},
+      {"check", 0, nullptr, 'c'},   {"threads", 1, nullptr, 't'},
+      {"window", 1, nullptr, 5},    {"list-unnormalized", 0, nullptr, 'l'},
+      {"list-normalized", 0, nullptr, 'L'},
+      {"all-forms", 2, nullptr, 'a'},
+      {"in-place", 0, nullptr, 'i'},
+      {"on-invalid", 1, nullptr, 6},
+      {"json", 0, nullptr, 'j'},
+      {nullptr, 0, nullptr, 0}};
 
   const icu::Normalizer2 *method = nullptr;
   UErrorCode err = U_ZERO_ERROR;
-  bool check = false;
+  norm_options nopts;
 
-  for (int val; (val = getopt_long(argc, argv, "vh", opts, nullptr)) != -1;) {
+  for (int val;
+       (val = getopt_long(argc, argv, "vhclLa::ijt:", opts, nullptr)) != -1;) {
     switch (val) {
     case 'v':
       std::cout << argv[0] << " version " << version << '\n';
       return 0;
     case 'h':
       std::cout << argv[0]
-                << " [--check] --nfc|--nfd|--nfkc|--nfkd [FILE ...]\n";
+                << " [--check|--list-unnormalized|--list-normalized|"
+                   "--in-place] [--json] [--on-invalid=fail|replace|skip] "
+                   "[--threads N] [--window SIZE] --nfc|--nfd|--nfkc|--nfkd|"
+                   "--nfkc-cf|--custom=PATH,NAME[,MODE] [FILE ...]\n"
+                << argv[0]
+                << " --all-forms[=text|json] [--on-invalid=fail|replace|skip] "
+                   "[--threads N] [--window SIZE] [FILE ...]\n";
       return 0;
     case 'c':
-      check = true;
+      nopts.check = true;
+      break;
+    case 'i':
+      nopts.in_place = true;
+      break;
+    case 'j':
+      nopts.json = true;
+      break;
+    case 'l':
+      nopts.check = true;
+      nopts.list = listing::FAILING;
+      break;
+    case 'L':
+      nopts.check = true;
+      nopts.list = listing::PASSING;
+      break;
+    case 'a':
+      nopts.check = true;
+      if (!optarg || std::strcmp(optarg, "text") == 0) {
+        nopts.list = listing::TABLE;
+      } else if (std::strcmp(optarg, "json") == 0) {
+        nopts.list = listing::JSON;
+      } else {
+        std::cerr << argv[0] << ": unknown --all-forms format '" << optarg
+                  << "'\n";
+        return 1;
+      }
+      break;
+    case 't':
+      nopts.threads = std::strtoul(optarg, nullptr, 10);
+      if (nopts.threads == 0) {
+        std::cerr << argv[0] << ": invalid number of threads '" << optarg
+                  << "'\n";
+        return 1;
+      }
+      break;
+    case 5:
+      nopts.window = parse_size(optarg);
+      if (nopts.window == 0) {
+        std::cerr << argv[0] << ": invalid window size '" << optarg << "'\n";
+        return 1;
+      }
+      break;
+    case 6:
+      if (std::strcmp(optarg, "fail") == 0) {
+        nopts.invalid = on_invalid::FAIL;
+      } else if (std::strcmp(optarg, "replace") == 0) {
+        nopts.invalid = on_invalid::REPLACE;
+      } else if (std::strcmp(optarg, "skip") == 0) {
+        nopts.invalid = on_invalid::SKIP;
+      } else {
+        std::cerr << argv[0] << ": unknown --on-invalid action '" << optarg
+                  << "'\n";
+        return 1;
+      }
       break;
     case 1:
       if (method) {
@@ -238,34 +1800,129 @@ int main(int argc, char **argv) {
       }
       method = icu::Normalizer2::getNFKDInstance(err);
       break;
+    case 7:
+      if (method) {
+        std::cerr << argv[0] << ": can only specify one normalization mode.\n";
+        return 1;
+      }
+      method = icu::Normalizer2::getNFKCCasefoldInstance(err);
+      break;
+    case 8:
+      if (method) {
+        std::cerr << argv[0] << ": can only specify one normalization mode.\n";
+        return 1;
+      }
+      method = custom_normalizer(optarg, err);
+      if (!method && U_SUCCESS(err)) {
+        std::cerr << argv[0] << ": invalid custom normalization '" << optarg
+                  << "'\n";
+        return 1;
+      }
+      break;
     case '?':
     default:
       return 1;
     }
   }
 
-  if (!method) {
-    std::cerr << argv[0] << ": No normalization mode given.\n";
-    return 1;
-  }
-
   if (U_FAILURE(err)) {
     std::cerr << argv[0] << ": Unable to open normalizer: " << u_errorName(err)
               << '\n';
     return 1;
   }
 
+  bool all_forms =
+      nopts.list == listing::TABLE || nopts.list == listing::JSON;
+  if (all_forms) {
+    if (method) {
+      std::cerr << argv[0]
+                << ": --all-forms can't be used with a normalization mode.\n";
+      return 1;
+    }
+  } else if (!method) {
+    std::cerr << argv[0] << ": No normalization mode given.\n";
+    return 1;
+  }
+
   int exit_code = 0;
 
+  if (nopts.json && nopts.check) {
+    std::cerr << argv[0] << ": --json can't be used with checking.\n";
+    return 1;
+  }
+
+  if (nopts.in_place) {
+    if (nopts.check) {
+      std::cerr << argv[0] << ": --in-place can't be used with checking.\n";
+      return 1;
+    }
+    if (optind == argc) {
+      std::cerr << argv[0] << ": --in-place needs files to normalize.\n";
+      return 1;
+    }
+    for (int i = optind; i < argc; i += 1) {
+      if (std::strcmp(argv[i], "-") == 0 ||
+          std::strcmp(argv[i], "/dev/stdin") == 0) {
+        std::cerr << argv[0]
+                  << ": can't normalize standard input in place.\n";
+        return 1;
+      }
+    }
+    try {
+      qc_table qc(method);
+      return in_place_files(argv[0], argv + optind, argc - optind, qc, nopts);
+    } catch (std::exception &e) {
+      std::cerr << argv[0] << ": " << e.what() << '\n';
+      return 1;
+    }
+  }
+
+  if (nopts.check) {
+    try {
+      std::vector<std::unique_ptr<qc_table>> tables;
+      form_set fs;
+      if (all_forms) {
+        for (auto instance :
+             {&icu::Normalizer2::getNFCInstance,
+              &icu::Normalizer2::getNFDInstance,
+              &icu::Normalizer2::getNFKCInstance,
+              &icu::Normalizer2::getNFKDInstance}) {
+          tables.emplace_back(new qc_table(instance(err)));
+          if (U_FAILURE(err)) {
+            throw std::runtime_error{"Unable to open normalizer: "s +
+                                     u_errorName(err)};
+          }
+        }
+        fs.names = {"nfc", "nfd", "nfkc", "nfkd"};
+      } else {
+        tables.emplace_back(new qc_table(method));
+      }
+      for (auto &qc : tables) {
+        fs.forms.push_back(qc.get());
+      }
+
+      char stdin_name[] = "-";
+      char *stdin_files[] = {stdin_name};
+      if (optind == argc) {
+        return check_files(argv[0], stdin_files, 1, fs, nopts);
+      }
+      return check_files(argv[0], argv + optind, argc - optind, fs, nopts);
+    } catch (std::exception &e) {
+      std::cerr << argv[0] << ": " << e.what() << '\n';
+      return 1;
+    }
+  }
+
   try {
     output_bytesink bs(STDOUT_FILENO);
+    qc_table qc(method);
 
     if (optind == argc) {
-      do_normalization("/dev/stdin", method, bs, check);
+      do_normalization("/dev/stdin", qc, bs, nopts);
     } else {
       for (int i = optind; i < argc; i += 1) {
         try {
-          do_normalization(argv[i], method, bs, check);
+          do_normalization(argv[i], qc, bs, nopts);
         } catch (std::invalid_argument &) {
           std::cerr << argv[0] << ": Unable to open '" << argv[i]
                     << "' for reading.\n";
@@ -273,6 +1930,7 @@ int main(int argc, char **argv) {
         }
       }
     }
+    bs.write_out();
   } catch (std::exception &e) {
     std::cerr << argv[0] << ": " << e.what() << '\n';
     return 1;
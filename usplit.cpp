@@ -21,18 +21,39 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <memory>
+#include <string>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <climits>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 #include <unicode/unistr.h>
 #include <unicode/ustdio.h>
+#include <unicode/ucnv.h>
+#include <unicode/ustring.h>
 #include <unicode/brkiter.h>
+#include <unicode/utext.h>
 #include <unicode/locid.h>
 #include <unicode/utf8.h>
 
+#include <unistd.h>
 #include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "json.hpp"
 #include "util.h"
@@ -47,17 +68,385 @@ enum class split_at { CP, CHAR, WORD, SENTENCE, UNSPEC };
 
 enum class output { TEXT, JSON };
 
+enum class offsets { NONE, TEXT, BINARY32, BINARY64 };
+
+// Buffered output written straight to a file descriptor, for splitters
+// that work on raw UTF-8. Anything already written to the same file
+// through iostreams or ICU has to be flushed first. Can also collect
+// the output in a string instead.
+class out_buffer {
+private:
+  int fd;
+  std::string *str;
+  std::unique_ptr<char[]> buf;
+  std::size_t used;
+
+public:
+  static constexpr std::size_t capacity = 256 * 1024;
+  explicit out_buffer(int fd_)
+      : fd(fd_), str(nullptr), buf(new char[capacity]), used(0) {}
+  explicit out_buffer(std::string *str_)
+      : fd(-1), str(str_), buf(new char[capacity]), used(0) {}
+  ~out_buffer() noexcept {
+    try {
+      flush();
+    } catch (std::exception &) {
+    }
+  }
+  // Returns space for at least n more bytes, n <= capacity. Call
+  // commit() with how many were used.
+  char *reserve(std::size_t n) {
+    if (capacity - used < n) {
+      flush();
+    }
+    return buf.get() + used;
+  }
+  void commit(std::size_t n) noexcept { used += n; }
+  void write(const char *, std::size_t);
+  void put(char c) {
+    *reserve(1) = c;
+    used += 1;
+  }
+  void flush();
+};
+
+constexpr std::size_t out_buffer::capacity;
+
+void out_buffer::write(const char *s, std::size_t len) {
+  while (len > 0) {
+    std::size_t n = std::min(len, capacity);
+    std::memcpy(reserve(n), s, n);
+    used += n;
+    s += n;
+    len -= n;
+  }
+}
+
+void out_buffer::flush() {
+  const char *p = buf.get();
+  std::size_t len = used;
+  used = 0;
+  if (str) {
+    str->append(p, len);
+    return;
+  }
+  while (len > 0) {
+    ssize_t n = ::write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"Unable to write to standard output: "s +
+                               std::strerror(errno)};
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+// Write the decimal digits of n to p, which needs room for 20 of them.
+// Returns how many were written.
+std::size_t format_uint(char *p, std::uint64_t n) {
+  char digits[20];
+  std::size_t len = 0;
+  do {
+    digits[len++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  for (std::size_t i = 0; i < len; i += 1) {
+    p[i] = digits[len - 1 - i];
+  }
+  return len;
+}
+
+// Writes a JSON array of strings as it goes, escaping each one straight
+// from the text it's in into the output buffer. nlohmann::json's
+// escaping is followed, so the output is the same as dumping an array
+// of the strings.
+class json_writer {
+private:
+  out_buffer out;
+  bool first;
+
+public:
+  explicit json_writer(int fd) : out(fd), first(true) { out.put('['); }
+  // Writes just the comma separated strings, for part of an array.
+  explicit json_writer(std::string *str) : out(str), first(true) {}
+  void string(const UChar *, int32_t);
+  void end() {
+    out.write("]\n", 2);
+    out.flush();
+  }
+  void flush() { out.flush(); }
+};
+
+void json_writer::string(const UChar *s, int32_t len) {
+  // Each UTF-16 code unit takes at most 6 bytes of output, as \u00XX.
+  constexpr int32_t slice = out_buffer::capacity / 6;
+  static const char hex[] = "0123456789abcdef";
+
+  if (!first) {
+    out.put(',');
+  }
+  first = false;
+  out.put('"');
+
+  for (int32_t i = 0; i < len;) {
+    int32_t end = i + std::min(len - i, slice);
+    if (end < len && U16_IS_LEAD(s[end - 1])) {
+      end -= 1;
+    }
+    char *const start = out.reserve(6 * (end - i));
+    char *p = start;
+
+    while (i < end) {
+#ifdef __SSE2__
+      // Copy 8 code units at a time as long as they're all printable
+      // ASCII that doesn't need escaping.
+      const __m128i bias = _mm_set1_epi16(0x20 - 0x8000);
+      const __m128i limit = _mm_set1_epi16(0x60 - 0x8000);
+      const __m128i quote = _mm_set1_epi16('"');
+      const __m128i backslash = _mm_set1_epi16('\\');
+      while (i + 8 <= end) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        __m128i plain = _mm_cmplt_epi16(_mm_sub_epi16(v, bias), limit);
+        plain = _mm_andnot_si128(_mm_cmpeq_epi16(v, quote), plain);
+        plain = _mm_andnot_si128(_mm_cmpeq_epi16(v, backslash), plain);
+        if (_mm_movemask_epi8(plain) != 0xFFFF) {
+          break;
+        }
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(p),
+                         _mm_packus_epi16(v, v));
+        p += 8;
+        i += 8;
+      }
+      if (i >= end) {
+        break;
+      }
+#endif
+
+      UChar32 c;
+      U16_NEXT(s, i, end, c);
+      switch (c) {
+      case '"':
+        *p++ = '\\';
+        *p++ = '"';
+        break;
+      case '\\':
+        *p++ = '\\';
+        *p++ = '\\';
+        break;
+      case '\b':
+        *p++ = '\\';
+        *p++ = 'b';
+        break;
+      case '\f':
+        *p++ = '\\';
+        *p++ = 'f';
+        break;
+      case '\n':
+        *p++ = '\\';
+        *p++ = 'n';
+        break;
+      case '\r':
+        *p++ = '\\';
+        *p++ = 'r';
+        break;
+      case '\t':
+        *p++ = '\\';
+        *p++ = 't';
+        break;
+      default:
+        if (c < 0x20) {
+          std::memcpy(p, "\\u00", 4);
+          p[4] = hex[c >> 4];
+          p[5] = hex[c & 0xF];
+          p += 6;
+        } else if (c < 0x80) {
+          *p++ = c;
+        } else {
+          if (U_IS_SURROGATE(c)) {
+            c = 0xFFFD;
+          }
+          int32_t n = 0;
+          U8_APPEND_UNSAFE(p, n, c);
+          p += n;
+        }
+      }
+    }
+    out.commit(p - start);
+  }
+
+  out.put('"');
+}
+
+// Writes the byte offsets of tokens in the input, instead of the
+// tokens themselves. Each token is a start and end offset, optionally
+// followed by the rule status of the boundary at its end, as a line of
+// tab separated numbers or as little-endian integers.
+class offset_writer {
+private:
+  out_buffer out;
+  offsets format;
+  bool status;
+  void put_int(char *, std::uint64_t);
+
+public:
+  offset_writer(offsets format_, bool status_)
+      : out(STDOUT_FILENO), format(format_), status(status_) {}
+  void add(std::uint64_t, std::uint64_t, int32_t);
+  void flush() { out.flush(); }
+};
+
+void offset_writer::put_int(char *p, std::uint64_t n) {
+  const int width = format == offsets::BINARY32 ? 4 : 8;
+  for (int i = 0; i < width; i += 1) {
+    p[i] = static_cast<char>(n >> (8 * i));
+  }
+}
+
+void offset_writer::add(std::uint64_t start, std::uint64_t end,
+                        int32_t rule) {
+  if (format == offsets::TEXT) {
+    char *const begin = out.reserve(3 * 21);
+    char *p = begin;
+    p += format_uint(p, start);
+    *p++ = '\t';
+    p += format_uint(p, end);
+    if (status) {
+      *p++ = '\t';
+      p += format_uint(p, rule);
+    }
+    *p++ = '\n';
+    out.commit(p - begin);
+    return;
+  }
+
+  if (format == offsets::BINARY32 && end > UINT32_MAX) {
+    throw std::runtime_error{"Offset too large for 32 bits"};
+  }
+  const std::size_t width = format == offsets::BINARY32 ? 4 : 8;
+  char *p = out.reserve(3 * width);
+  put_int(p, start);
+  put_int(p + width, end);
+  if (status) {
+    put_int(p + 2 * width, rule);
+  }
+  out.commit((status ? 3 : 2) * width);
+}
+
+// True if a file is read or written as UTF-8.
+bool is_utf8(UFILE *f) {
+  UErrorCode err = U_ZERO_ERROR;
+  UConverter *conv = u_fgetConverter(f);
+  if (!conv) {
+    return false;
+  }
+  const char *name = ucnv_getName(conv, &err);
+  return U_SUCCESS(err) && ucnv_compareNames(name, "UTF-8") == 0;
+}
+
+// Longest piece of text write_boundaries() gives a break iterator at
+// once. ICU offsets are 32-bit.
+constexpr std::size_t boundary_window = 1024 * 1024 * 1024;
+
+// Write the offsets of the tokens a break iterator finds in UTF-8 text
+// that starts base bytes into the input, except those skip() rejects
+// given their start and end. new_text() is called each time the
+// iterator is given text.
+// The text is iterated in place, so offsets are in bytes. ut is reused
+// from one call to the next, so opening it doesn't allocate each time.
+// Text longer than boundary_window is iterated a piece at a time. A
+// boundary near the end of a piece can still move with what comes
+// after it, so like sentence_splitter::emit_sentences(), only the
+// boundaries up to the last but one are written, and the next piece
+// starts there.
+template <class NewText, class Skip>
+void write_boundaries(icu::BreakIterator *bi, icu::LocalUTextPointer &ut,
+                      const char *s, std::size_t len, std::size_t base,
+                      offset_writer &out, NewText new_text, Skip skip) {
+  for (;;) {
+    const bool final = len <= boundary_window;
+    std::size_t n = final ? len : boundary_window;
+    while (!final && n > 0 && U8_IS_TRAIL(s[n])) {
+      n -= 1;
+    }
+    UErrorCode err = U_ZERO_ERROR;
+    UText *opened = utext_openUTF8(ut.getAlias(), s, n, &err);
+    if (!ut.isValid()) {
+      ut.adoptInstead(opened);
+    }
+    bi->setText(ut.getAlias(), err);
+    if (U_FAILURE(err)) {
+      throw std::runtime_error{"Unable to read text: "s + u_errorName(err)};
+    }
+    new_text();
+
+    int32_t stable = n;
+    if (!final) {
+      bi->last();
+      bi->previous();
+      stable = bi->previous();
+      if (stable == icu::BreakIterator::DONE || stable == 0) {
+        throw std::runtime_error{"Token too long for offsets"};
+      }
+    }
+    int32_t offset = bi->first();
+    for (auto pos = bi->next();
+         pos != icu::BreakIterator::DONE && pos <= stable; pos = bi->next()) {
+      if (!skip(offset, pos)) {
+        out.add(base + offset, base + pos, bi->getRuleStatus());
+      }
+      offset = pos;
+    }
+    if (final) {
+      return;
+    }
+    s += stable;
+    len -= stable;
+    base += stable;
+  }
+}
+
 class splitter {
+private:
+  UFILE *ustdout;
+  std::unique_ptr<out_buffer> utf8_out;
+  std::unique_ptr<json_writer> json;
+  std::string utf8_delim;
+  bool first;
+
 protected:
   output mode;
   icu::UnicodeString delim;
+  // Where the tokens of a shard go with split_threaded(), instead of
+  // standard output.
+  std::string *capture;
+  splitter(const splitter &other) : splitter(other.delim, other.mode) {}
   void print_delim(UFILE *);
+  std::string utf8_delimiter() const;
+  void flush_stdout();
+  bool raw_utf8(UFILE *);
+  void begin_tokens();
+  void emit(const UChar *, int32_t);
+  void end_tokens();
+  static void set_text(icu::BreakIterator *, const icu::UnicodeString &);
+  // Whether the input can be cut after any line, instead of only after
+  // blank lines, and still give the same tokens.
+  virtual bool line_shards() const { return false; }
+  virtual bool split_shard(const char *, std::size_t);
+  virtual std::unique_ptr<splitter> clone() const = 0;
+  virtual void token_offsets(const char *, std::size_t, std::size_t,
+                             offset_writer &) = 0;
 
 public:
   splitter(const icu::UnicodeString &delim_, output mode_)
-      : delim(delim_), mode(mode_){};
+      : ustdout(nullptr), first(true), mode(mode_), delim(delim_),
+        capture(nullptr){};
   virtual ~splitter() {}
   virtual void split(UFILE *) = 0;
+  bool split_threaded(UFILE *, unsigned int);
+  void split_offsets(UFILE *, offset_writer &);
 };
 
 void splitter::print_delim(UFILE *uf) {
@@ -68,7 +457,438 @@ void splitter::print_delim(UFILE *uf) {
   }
 }
 
+// The delimiter as UTF-8. An empty one is a null byte.
+std::string splitter::utf8_delimiter() const {
+  std::string d;
+  delim.toUTF8String(d);
+  if (d.empty()) {
+    d.push_back('\0');
+  }
+  return d;
+}
+
+// Flush what's been written to standard output through iostreams and
+// ICU, before writing to it directly.
+void splitter::flush_stdout() {
+  std::cout.flush();
+  u_fflush(u_get_stdout());
+}
+
+// Start writing the tokens of one input. Text goes straight into an
+// output buffer when standard output is UTF-8, and through ICU's
+// converter otherwise.
+void splitter::begin_tokens() {
+  first = true;
+  if (mode == output::JSON) {
+    if (capture) {
+      json.reset(new json_writer(capture));
+    } else {
+      flush_stdout();
+      json.reset(new json_writer(STDOUT_FILENO));
+    }
+    return;
+  }
+
+  if (capture) {
+    utf8_out.reset(new out_buffer(capture));
+  } else {
+    UErrorCode err = U_ZERO_ERROR;
+    ustdout = u_get_stdout();
+    UConverter *conv = u_fgetConverter(ustdout);
+    const char *name = conv ? ucnv_getName(conv, &err) : nullptr;
+    if (!name || U_FAILURE(err) || ucnv_compareNames(name, "UTF-8") != 0) {
+      return;
+    }
+    flush_stdout();
+    utf8_out.reset(new out_buffer(STDOUT_FILENO));
+  }
+  utf8_delim = utf8_delimiter();
+}
+
+// Write a token, given as a view of the text it's in, with a delimiter
+// or comma before it if it's not the first.
+void splitter::emit(const UChar *s, int32_t len) {
+  if (json) {
+    json->string(s, len);
+    first = false;
+    return;
+  }
+
+  if (!utf8_out) {
+    if (!first) {
+      print_delim(ustdout);
+    }
+    first = false;
+    u_file_write(s, len, ustdout);
+    return;
+  }
+
+  if (!first) {
+    utf8_out->write(utf8_delim.data(), utf8_delim.size());
+  }
+  first = false;
+  // Each UTF-16 code unit is at most 3 bytes of UTF-8.
+  constexpr int32_t slice = out_buffer::capacity / 3;
+  for (int32_t i = 0; i < len;) {
+    int32_t n = std::min(len - i, slice);
+    if (i + n < len && U16_IS_LEAD(s[i + n - 1])) {
+      n -= 1;
+    }
+    int32_t written = 0;
+    UErrorCode err = U_ZERO_ERROR;
+    u_strToUTF8WithSub(utf8_out->reserve(3 * n), 3 * n, &written, s + i, n,
+                       0xFFFD, nullptr, &err);
+    if (U_FAILURE(err)) {
+      throw std::runtime_error{"Unable to convert text: "s +
+                               u_errorName(err)};
+    }
+    utf8_out->commit(written);
+    i += n;
+  }
+}
+
+// Finish writing the tokens of one input.
+void splitter::end_tokens() {
+  if (json) {
+    if (capture) {
+      json->flush();
+    } else {
+      json->end();
+    }
+    json.reset();
+  } else if (utf8_out) {
+    utf8_out->flush();
+    utf8_out.reset();
+  }
+}
+
+// Point an iterator at a string. setText() given the string itself
+// shares its buffer, so the next change to the string has to copy it
+// first; iterating it through a UText over the buffer doesn't.
+void splitter::set_text(icu::BreakIterator *bi, const icu::UnicodeString &s) {
+  UErrorCode err = U_ZERO_ERROR;
+  UText ut = UTEXT_INITIALIZER;
+  utext_openUChars(&ut, s.getBuffer(), s.length(), &err);
+  bi->setText(&ut, err);
+  utext_close(&ut);
+  if (U_FAILURE(err)) {
+    throw std::runtime_error{"Unable to read text: "s + u_errorName(err)};
+  }
+}
+
+// True if the input, and standard output for text, are UTF-8, so they
+// can be read and written as raw bytes, bypassing the converters.
+// Flushes what's been written to standard output so far if so.
+bool splitter::raw_utf8(UFILE *uf) {
+  if (!is_utf8(uf) || (mode == output::TEXT && !is_utf8(u_get_stdout()))) {
+    return false;
+  }
+  flush_stdout();
+  return true;
+}
+
+// The rest of a regular file from its current position, mapped into
+// memory.
+class mapped_file {
+private:
+  void *mem;
+  std::size_t maplen;
+  std::size_t start;
+
+public:
+  explicit mapped_file(int fd);
+  ~mapped_file() {
+    if (mem != MAP_FAILED) {
+      munmap(mem, maplen);
+    }
+  }
+  bool mapped() const { return mem != MAP_FAILED; }
+  const char *data() const { return static_cast<const char *>(mem) + start; }
+  std::size_t size() const { return maplen - start; }
+};
+
+mapped_file::mapped_file(int fd) : mem(MAP_FAILED), maplen(0), start(0) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return;
+  }
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  if (pos < 0 || pos >= st.st_size) {
+    return;
+  }
+  maplen = st.st_size;
+  start = pos;
+  mem = mmap(nullptr, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mem != MAP_FAILED) {
+    madvise(mem, maplen, MADV_SEQUENTIAL);
+  }
+}
+
+// Size of the blocks split_offsets() reads input that can't be mapped
+// in.
+constexpr std::size_t offset_block = 1024 * 1024;
+
+// Write the offsets of the tokens of a UTF-8 input. A file is mapped
+// into memory. Anything else is read a block at a time; what's been
+// read is split up to its last blank line (Or line, for splitters that
+// can be cut after any one), with base the offset of the start of the
+// buffer in the input, and the rest is carried over to the front of the
+// next read. The buffer only grows for paragraphs longer than a block.
+void splitter::split_offsets(UFILE *uf, offset_writer &out) {
+  if (!is_utf8(uf)) {
+    throw std::runtime_error{"Offsets need UTF-8 input"};
+  }
+  flush_stdout();
+  int fd = fileno(u_fgetfile(uf));
+  mapped_file input(fd);
+  if (input.mapped()) {
+    token_offsets(input.data(), input.size(), 0, out);
+    out.flush();
+    return;
+  }
+
+  const char *cut = line_shards() ? "\n" : "\n\n";
+  const std::size_t cut_len = std::strlen(cut);
+  std::unique_ptr<char[]> buf{new char[offset_block]};
+  std::size_t capacity = offset_block;
+  std::size_t used = 0;
+  std::size_t base = 0;
+  // Where to start looking for the next cut.
+  std::size_t searched = 0;
+  for (;;) {
+    if (used == capacity) {
+      std::unique_ptr<char[]> bigger{new char[capacity * 2]};
+      std::memcpy(bigger.get(), buf.get(), used);
+      buf = std::move(bigger);
+      capacity *= 2;
+    }
+    ssize_t n = read(fd, buf.get() + used, capacity - used);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"Unable to read input: "s +
+                               std::strerror(errno)};
+    }
+    if (n == 0) {
+      break;
+    }
+    used += n;
+
+    std::size_t safe = 0;
+    for (const char *p;
+         (p = static_cast<const char *>(memmem(buf.get() + searched,
+                                               used - searched, cut,
+                                               cut_len)));) {
+      safe = p - buf.get() + cut_len;
+      searched = safe;
+    }
+    if (safe == 0) {
+      searched = used - std::min(used, cut_len - 1);
+      continue;
+    }
+    token_offsets(buf.get(), safe, base, out);
+    std::memmove(buf.get(), buf.get() + safe, used - safe);
+    used -= safe;
+    base += safe;
+    searched = 0;
+  }
+  token_offsets(buf.get(), used, base, out);
+  out.flush();
+}
+
+// Split a shard of UTF-8 text into capture. Returns true if there were
+// any tokens.
+bool splitter::split_shard(const char *s, std::size_t len) {
+  // Never more UTF-16 code units than UTF-8 bytes.
+  std::vector<UChar> text(len + 1);
+  UErrorCode err = U_ZERO_ERROR;
+  int32_t n = 0;
+  u_strFromUTF8WithSub(text.data(), len, &n, s, len, 0xFFFD, nullptr, &err);
+  if (U_FAILURE(err)) {
+    throw std::runtime_error{"Unable to convert text: "s + u_errorName(err)};
+  }
+
+  ufp uf{u_fstropen(text.data(), n, nullptr), &u_fclose};
+  if (!uf) {
+    throw std::runtime_error{"Unable to read text"};
+  }
+  split(uf.get());
+  return !first;
+}
+
+// Shards of the input handed to the threads of split_threaded() are
+// about this big.
+constexpr std::size_t shard_size = 1024 * 1024;
+
+// Split a UTF-8 file with several threads. It's mapped into memory and
+// cut into shards at blank lines (Or any line, for splitters where
+// that's safe), each thread splits a shard at a time with its own copy
+// of the splitter, and the results are written out in order with
+// delimiters between them. Returns false without writing anything if
+// the input isn't a big enough UTF-8 file, for split() to handle.
+bool splitter::split_threaded(UFILE *uf, unsigned int nthreads) {
+  // Long delimiters don't fit in cp_splitter's output batches.
+  if (nthreads < 2 || delim.length() >= 4096 || !raw_utf8(uf)) {
+    return false;
+  }
+  mapped_file input(fileno(u_fgetfile(uf)));
+  if (!input.mapped() || input.size() <= shard_size) {
+    return false;
+  }
+  const char *s = input.data();
+  const std::size_t len = input.size();
+
+  const char *cut = line_shards() ? "\n" : "\n\n";
+  const std::size_t cut_len = std::strlen(cut);
+  std::vector<std::size_t> starts{0};
+  while (starts.back() < len) {
+    std::size_t from = std::min(len, starts.back() + shard_size);
+    const void *p = memmem(s + from, len - from, cut, cut_len);
+    std::size_t next =
+        p ? static_cast<const char *>(p) - s + cut_len : len;
+    // A shard has to fit in an ICU string.
+    if (next - starts.back() > INT32_MAX / 2) {
+      return false;
+    }
+    starts.push_back(next);
+  }
+  const std::size_t nshards = starts.size() - 1;
+  if (nshards < 2) {
+    return false;
+  }
+  const std::size_t window = 2 * nthreads;
+
+  struct slot {
+    std::string out;
+    bool any = false;
+    bool ready = false;
+  };
+  std::vector<slot> slots(window);
+  std::size_t next_shard = 0, next_write = 0;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::exception_ptr failure;
+
+  auto fail = [&](std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!failure) {
+      failure = e;
+    }
+    cv.notify_all();
+  };
+
+  auto worker = [&]() {
+    std::unique_ptr<splitter> sp;
+    try {
+      sp = clone();
+    } catch (...) {
+      fail(std::current_exception());
+      return;
+    }
+    for (;;) {
+      std::size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() {
+          return failure || next_shard >= nshards ||
+                 next_shard < next_write + window;
+        });
+        if (failure || next_shard >= nshards) {
+          return;
+        }
+        i = next_shard++;
+      }
+      std::string out;
+      bool any;
+      try {
+        sp->capture = &out;
+        any = sp->split_shard(s + starts[i], starts[i + 1] - starts[i]);
+      } catch (...) {
+        fail(std::current_exception());
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      slots[i % window].out.swap(out);
+      slots[i % window].any = any;
+      slots[i % window].ready = true;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int n = 0; n < std::min<std::size_t>(nthreads, nshards);
+       n += 1) {
+    threads.emplace_back(worker);
+  }
+
+  try {
+    out_buffer out(STDOUT_FILENO);
+    std::string sep = ",";
+    if (mode == output::JSON) {
+      out.put('[');
+    } else {
+      sep = utf8_delimiter();
+    }
+    bool first_shard = true, done = true;
+    std::string text;
+    for (std::size_t i = 0; i < nshards; i += 1) {
+      bool any;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() { return failure || slots[i % window].ready; });
+        if (failure) {
+          done = false;
+          break;
+        }
+        text.swap(slots[i % window].out);
+        any = slots[i % window].any;
+        slots[i % window].ready = false;
+      }
+      if (any) {
+        if (!first_shard) {
+          out.write(sep.data(), sep.size());
+        }
+        first_shard = false;
+        out.write(text.data(), text.size());
+      }
+      text.clear();
+      std::lock_guard<std::mutex> lock(mtx);
+      next_write = i + 1;
+      cv.notify_all();
+    }
+    if (done && mode == output::JSON) {
+      out.write("]\n", 2);
+    }
+    out.flush();
+  } catch (...) {
+    fail(std::current_exception());
+  }
+
+  for (auto &t : threads) {
+    t.join();
+  }
+  if (failure) {
+    std::rethrow_exception(failure);
+  }
+  return true;
+}
+
 class cp_splitter : public splitter {
+private:
+  std::size_t write_cps(const std::uint8_t *, std::size_t, std::size_t,
+                        out_buffer &, const std::string &, bool &);
+  void split_utf8(int);
+
+protected:
+  bool line_shards() const override { return true; }
+  bool split_shard(const char *, std::size_t) override;
+  std::unique_ptr<splitter> clone() const override {
+    return std::make_unique<cp_splitter>(*this);
+  }
+  void token_offsets(const char *, std::size_t, std::size_t,
+                     offset_writer &) override;
+
 public:
   cp_splitter(const icu::UnicodeString &delim_, output mode_)
       : splitter(delim_, mode_) {}
@@ -76,7 +896,164 @@ public:
   void split(UFILE *) override;
 };
 
+// Write the codepoints of UTF-8 text that start before end, each
+// preceded by delimiter d or a comma unless it's the first. Ill-formed
+// sequences become U+FFFD, the same as with a converter. Runs of ASCII
+// are interleaved with a single byte delimiter 16 at a time. Returns
+// where it stopped.
+std::size_t cp_splitter::write_cps(const std::uint8_t *s, std::size_t end,
+                                   std::size_t len, out_buffer &out,
+                                   const std::string &d, bool &first) {
+  std::size_t i = 0;
+
+  // Each input byte is at most one codepoint, which takes at most this
+  // much output, so a batch of input can be written without checking
+  // for room as it goes.
+  const std::size_t per_byte = mode == output::TEXT ? d.size() + 3 : 11;
+  const std::size_t batch = std::max<std::size_t>(
+      1, std::min<std::size_t>(4096, out_buffer::capacity / per_byte));
+
+  while (i < end) {
+    const std::size_t batch_end = std::min(end, i + batch);
+    char *const start_p = out.reserve(per_byte * batch + U8_MAX_LENGTH);
+    char *p = start_p;
+
+    while (i < batch_end) {
+#ifdef __SSE2__
+      if (mode == output::TEXT && d.size() == 1 && !first) {
+        const __m128i dv = _mm_set1_epi8(d[0]);
+        while (i + 16 <= batch_end) {
+          __m128i v =
+              _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+          if (_mm_movemask_epi8(v)) {
+            break;
+          }
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(p),
+                           _mm_unpacklo_epi8(dv, v));
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(p + 16),
+                           _mm_unpackhi_epi8(dv, v));
+          p += 32;
+          i += 16;
+        }
+        if (i >= batch_end) {
+          break;
+        }
+      }
+#endif
+
+      UChar32 c;
+      std::size_t start = i;
+      U8_NEXT(s, i, len, c);
+      if (mode == output::TEXT) {
+        if (!first) {
+          if (d.size() == 1) {
+            *p++ = d[0];
+          } else {
+            std::memcpy(p, d.data(), d.size());
+            p += d.size();
+          }
+        }
+        if (c < 0) {
+          std::memcpy(p, "\xEF\xBF\xBD", 3);
+          p += 3;
+        } else {
+          std::memcpy(p, s + start, U8_MAX_LENGTH);
+          p += i - start;
+        }
+      } else { // JSON
+        if (!first) {
+          *p++ = ',';
+        }
+        p += format_uint(p, c < 0 ? 0xFFFD : c);
+      }
+      first = false;
+    }
+    out.commit(p - start_p);
+  }
+  return i;
+}
+
+// Split UTF-8 into codepoints a block at a time, read straight from the
+// file.
+void cp_splitter::split_utf8(int fd) {
+  constexpr std::size_t block = 256 * 1024;
+  std::unique_ptr<char[]> in{new char[block + U8_MAX_LENGTH]};
+  std::size_t carry = 0;
+  out_buffer out(STDOUT_FILENO);
+  const std::string d = utf8_delimiter();
+  bool first = true;
+
+  if (mode == output::JSON) {
+    out.put('[');
+  }
+
+  for (;;) {
+    ssize_t n = read(fd, in.get() + carry, block);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error{"Unable to read input: "s +
+                               std::strerror(errno)};
+    }
+    const auto *s = reinterpret_cast<const std::uint8_t *>(in.get());
+    const std::size_t len = carry + n;
+    // Unless this is the end, stop short of a character that might
+    // continue in the next block.
+    const std::size_t end =
+        n == 0 ? len : len - std::min<std::size_t>(len, U8_MAX_LENGTH - 1);
+    std::size_t i = write_cps(s, end, len, out, d, first);
+
+    if (n == 0) {
+      break;
+    }
+    carry = len - i;
+    std::memmove(in.get(), in.get() + i, carry);
+  }
+
+  if (mode == output::JSON) {
+    out.write("]\n", 2);
+  }
+}
+
+// Shards are split straight from the mapped UTF-8.
+bool cp_splitter::split_shard(const char *text, std::size_t len) {
+  const auto *s = reinterpret_cast<const std::uint8_t *>(text);
+  const std::string d = utf8_delimiter();
+  out_buffer out(capture);
+  bool first = true;
+
+  // write_cps() reads a few bytes past each character, which could be
+  // past the end of the mapping, so the last ones are copied out first.
+  std::size_t i =
+      write_cps(s, len - std::min<std::size_t>(len, U8_MAX_LENGTH - 1), len,
+                out, d, first);
+  std::uint8_t tail[2 * U8_MAX_LENGTH] = {};
+  std::memcpy(tail, s + i, len - i);
+  write_cps(tail, len - i, len - i, out, d, first);
+  out.flush();
+  return !first;
+}
+
+// Ill-formed sequences are one token each, like the U+FFFD they become.
+void cp_splitter::token_offsets(const char *text, std::size_t len,
+                                std::size_t base, offset_writer &out) {
+  const auto *s = reinterpret_cast<const std::uint8_t *>(text);
+  for (std::size_t i = 0; i < len;) {
+    std::size_t start = i;
+    UChar32 c;
+    U8_NEXT(s, i, len, c);
+    out.add(base + start, base + i, 0);
+  }
+}
+
 void cp_splitter::split(UFILE *uf) {
+  // Long delimiters don't fit in split_utf8()'s output batches.
+  if (delim.length() < 4096 && raw_utf8(uf)) {
+    split_utf8(fileno(u_fgetfile(uf)));
+    return;
+  }
+
   UChar32 c;
   UFILE *ustdout = mode == output::TEXT ? u_get_stdout() : nullptr;
   bool first = true;
@@ -118,81 +1095,218 @@ void cp_splitter::split(UFILE *uf) {
 class break_splitter : public splitter {
 protected:
   std::unique_ptr<icu::BreakIterator> bi;
-  virtual bool skip() { return false; }
+  virtual bool skip(int32_t, int32_t) { return false; }
+  // Called when the iterator is about to get new text.
+  virtual void new_text() {}
   break_splitter(const icu::UnicodeString &delim_, output mode_)
       : splitter(delim_, mode_) {}
+  break_splitter(const break_splitter &other)
+      : splitter(other), bi(other.bi->clone()) {}
+  void token_offsets(const char *, std::size_t, std::size_t,
+                     offset_writer &) override;
 
 public:
-  break_splitter(split_at which, icu::Locale &loc,
-                 const icu::UnicodeString &delim_, output mode_);
   ~break_splitter() override {}
   void split(UFILE *) override;
 };
 
-break_splitter::break_splitter(split_at which, icu::Locale &loc,
-                               const icu::UnicodeString &delim_, output mode_)
-    : splitter(delim_, mode_) {
-  UErrorCode err = U_ZERO_ERROR;
-  bi = std::unique_ptr<icu::BreakIterator>([&]() {
-    switch (which) {
-    case split_at::SENTENCE:
-      return icu::BreakIterator::createSentenceInstance(loc, err);
-    default:
-      throw std::runtime_error{"Unsupported break iterator type"};
+// Paragraphs are read the way uu::getparagraph() does it, but straight
+// into one string that's reused, so reading them doesn't allocate
+// memory once it's grown to fit the longest one.
+void break_splitter::split(UFILE *uf) {
+  UChar buffer[4096];
+  icu::UnicodeString para;
+  bool line_start = true;
+
+  auto split_para = [&]() {
+    new_text();
+    set_text(bi.get(), para);
+    const UChar *text = para.getBuffer();
+    int32_t offset = bi->first();
+    for (auto pos = bi->next(); pos != icu::BreakIterator::DONE;
+         pos = bi->next()) {
+      if (!skip(offset, pos)) {
+        emit(text + offset, pos - offset);
+      }
+      offset = pos;
+    }
+    para.remove();
+  };
+
+  begin_tokens();
+  while (u_fgets(buffer, 4095, uf)) {
+    int32_t len = u_strlen(buffer);
+    bool newline = len > 0 && buffer[len - 1] == u'\n';
+    if (line_start) {
+      if (len == 1 && newline) {
+        // A blank line ends the paragraph.
+        split_para();
+        continue;
+      }
+      if (!para.isEmpty()) {
+        para.append(u' ');
+      }
+    }
+    para.append(buffer, len - newline);
+    line_start = newline;
+  }
+  if (!para.isEmpty()) {
+    split_para();
+  }
+  end_tokens();
+}
+
+// Paragraphs are found the same way uu::getparagraph() does it. Joining
+// their lines with spaces doesn't change their length, so offsets in
+// the joined text are offsets in the input too.
+void break_splitter::token_offsets(const char *s, std::size_t len,
+                                   std::size_t base, offset_writer &out) {
+  std::string para;
+  icu::LocalUTextPointer ut;
+  auto paragraph = [&](std::size_t start, std::size_t end) {
+    // A paragraph of one line is iterated in place.
+    const char *text = s + start;
+    if (std::memchr(text, '\n', end - start)) {
+      para.assign(text, end - start);
+      std::replace(para.begin(), para.end(), '\n', ' ');
+      text = para.data();
+    }
+    write_boundaries(
+        bi.get(), ut, text, end - start, base + start, out,
+        [this]() { new_text(); },
+        [this](int32_t start, int32_t end) { return skip(start, end); });
+  };
+
+  std::size_t start = 0;
+  for (std::size_t pos = 0; pos < len;) {
+    const void *nl = std::memchr(s + pos, '\n', len - pos);
+    if (!nl) {
+      break;
+    }
+    std::size_t eol = static_cast<const char *>(nl) - s;
+    if (eol == pos) {
+      // A blank line ends the paragraph, without the newline before it.
+      paragraph(start, pos > start ? pos - 1 : start);
+      start = eol + 1;
     }
-  }());
+    pos = eol + 1;
+  }
+  paragraph(start, len > start && s[len - 1] == '\n' ? len - 1 : len);
+}
+
+// Splits sentences without holding a whole paragraph in memory. The
+// paragraph text is built up the same way uu::getparagraph() does it,
+// but sentences are written out as soon as their ends are certain.
+class sentence_splitter : public break_splitter {
+private:
+  // How much text to gather before looking for finished sentences.
+  static constexpr int32_t scan_size = 64 * 1024;
+  void emit_sentences(icu::UnicodeString &text, bool final);
+
+protected:
+  std::unique_ptr<splitter> clone() const override {
+    return std::make_unique<sentence_splitter>(*this);
+  }
+
+public:
+  sentence_splitter(icu::Locale &loc, const icu::UnicodeString &delim_,
+                    output mode_);
+  ~sentence_splitter() override {}
+  void split(UFILE *) override;
+};
+
+constexpr int32_t sentence_splitter::scan_size;
+
+sentence_splitter::sentence_splitter(icu::Locale &loc,
+                                     const icu::UnicodeString &delim_,
+                                     output mode_)
+    : break_splitter(delim_, mode_) {
+  UErrorCode err = U_ZERO_ERROR;
+  bi = std::unique_ptr<icu::BreakIterator>(
+      icu::BreakIterator::createSentenceInstance(loc, err));
   if (U_FAILURE(err)) {
     throw std::runtime_error{"Unable to create iterator: "s + u_errorName(err)};
   }
 }
 
-void break_splitter::split(UFILE *uf) {
-  icu::UnicodeString para;
-  int32_t offset = 0;
-  UFILE *ustdout = mode == output::TEXT ? u_get_stdout() : nullptr;
-  bool first = true;
+// Emit the sentences at the start of text and remove them from it. At
+// the end of a paragraph that's everything. Otherwise a boundary can
+// still move until another one follows it, since the rules look past a
+// full stop over any number of spaces and punctuation to decide, so the
+// last sentence and the partial one after it are held back.
+void sentence_splitter::emit_sentences(icu::UnicodeString &text, bool final) {
+  set_text(bi.get(), text);
+  int32_t stable = bi->last();
+  if (!final) {
+    bi->previous();
+    stable = bi->previous();
+    if (stable == icu::BreakIterator::DONE) {
+      return;
+    }
+  }
 
-  if (mode == output::JSON) {
-    std::cout << '[';
+  const UChar *s = text.getBuffer();
+  int32_t offset = bi->first();
+  for (auto pos = bi->next(); pos != icu::BreakIterator::DONE && pos <= stable;
+       pos = bi->next()) {
+    emit(s + offset, pos - offset);
+    offset = pos;
   }
+  text.remove(0, stable);
+}
 
-  while (uu::getparagraph(uf, &para, true, false)) {
-    bi->setText(para);
-    for (auto pos = bi->first(); pos != icu::BreakIterator::DONE;
-         pos = bi->next()) {
-      if (!skip() && pos > offset) {
-        icu::UnicodeString token;
-        para.extractBetween(offset, pos, token);
-        if (mode == output::TEXT) {
-          if (!first) {
-            print_delim(ustdout);
-          }
-          first = false;
-          u_file_write(token.getBuffer(), token.length(), ustdout);
-        } else { // JSON
-          if (!first) {
-            std::cout << ',';
-          }
-          first = false;
-          std::string utf8s;
-          token.toUTF8String(utf8s);
-          std::cout << nlohmann::json(utf8s);
-        }
+void sentence_splitter::split(UFILE *uf) {
+  UChar buffer[4096];
+  icu::UnicodeString para;
+  int32_t scan_at = scan_size;
+  bool line_start = true;
+  bool continued = false;
+
+  begin_tokens();
+  while (u_fgets(buffer, 4095, uf)) {
+    int32_t len = u_strlen(buffer);
+    bool newline = len > 0 && buffer[len - 1] == u'\n';
+    if (line_start) {
+      if (len == 1 && newline) {
+        // A blank line ends the paragraph.
+        emit_sentences(para, true);
+        scan_at = scan_size;
+        continued = false;
+        continue;
       }
-      offset = pos;
+      if (continued) {
+        para.append(u' ');
+      }
+      continued = true;
+    }
+    para.append(buffer, len - newline);
+    line_start = newline;
+    if (para.length() >= scan_at) {
+      emit_sentences(para, false);
+      // Wait for the leftover to at least double before looking again,
+      // so one very long sentence is still scanned in linear time.
+      scan_at = std::max(scan_size, 2 * para.length());
     }
   }
-
-  if (mode == output::JSON) {
-    std::cout << "]\n";
-  }
+  emit_sentences(para, true);
+  end_tokens();
 }
 
 class charbreak_splitter : public splitter {
 private:
   std::unique_ptr<icu::BreakIterator> bi;
 
+protected:
+  bool line_shards() const override { return true; }
+  std::unique_ptr<splitter> clone() const override {
+    return std::make_unique<charbreak_splitter>(*this);
+  }
+  void token_offsets(const char *, std::size_t, std::size_t,
+                     offset_writer &) override;
+
 public:
+  charbreak_splitter(const charbreak_splitter &other)
+      : splitter(other), bi(other.bi->clone()) {}
   charbreak_splitter(icu::Locale &loc, const icu::UnicodeString &delim_,
                      output mode_);
   ~charbreak_splitter() override {}
@@ -213,57 +1327,77 @@ charbreak_splitter::charbreak_splitter(icu::Locale &loc,
 
 void charbreak_splitter::split(UFILE *uf) {
   icu::UnicodeString line;
-  int32_t offset = 0;
-  UFILE *ustdout = mode == output::TEXT ? u_get_stdout() : nullptr;
-  bool first = true;
-
-  if (mode == output::JSON) {
-    std::cout << '[';
-  }
 
+  begin_tokens();
   while (uu::getline(uf, &line, true, true)) {
-    bi->setText(line);
-    for (auto pos = bi->first(); pos != icu::BreakIterator::DONE;
+    set_text(bi.get(), line);
+    const UChar *text = line.getBuffer();
+    int32_t offset = bi->first();
+    for (auto pos = bi->next(); pos != icu::BreakIterator::DONE;
          pos = bi->next()) {
-      icu::UnicodeString token;
-      line.extractBetween(offset, pos, token);
-      if (mode == output::TEXT) {
-        if (!first) {
-          print_delim(ustdout);
-        }
-        first = false;
-        u_file_write(token.getBuffer(), token.length(), ustdout);
-      } else { // JSON
-        if (!first) {
-          std::cout << ',';
-        }
-        first = false;
-        std::string utf8s;
-        token.toUTF8String(utf8s);
-        std::cout << nlohmann::json(utf8s);
-      }
+      emit(text + offset, pos - offset);
       offset = pos;
     }
   }
+  end_tokens();
+}
 
-  if (mode == output::JSON) {
-    std::cout << "]\n";
+// Each line is split on its own, as with split().
+void charbreak_splitter::token_offsets(const char *s, std::size_t len,
+                                       std::size_t base,
+                                       offset_writer &out) {
+  icu::LocalUTextPointer ut;
+  for (std::size_t pos = 0; pos < len;) {
+    const void *nl = std::memchr(s + pos, '\n', len - pos);
+    std::size_t eol = nl ? static_cast<const char *>(nl) - s + 1 : len;
+    write_boundaries(
+        bi.get(), ut, s + pos, eol - pos, base + pos, out, []() {},
+        [](int32_t, int32_t) { return false; });
+    pos = eol;
   }
 }
 
+// Which words to keep, on top of always leaving out the ones that
+// aren't numbers, letters, kana or ideographs.
+struct word_filter {
+  // A bit for each word rule status range to keep, 1 << (status / 100).
+  // 0 keeps them all.
+  unsigned int kinds = 0;
+  // The number of characters (Extended grapheme clusters) allowed.
+  int32_t min_length = 0;
+  int32_t max_length = INT32_MAX;
+};
+
 class wordbreak_splitter : public break_splitter {
+private:
+  word_filter filter;
+  // Only used to count characters when there are length limits.
+  std::unique_ptr<icu::BreakIterator> chars;
+  bool chars_ready = false;
+  bool length_ok(int32_t, int32_t);
+
 protected:
-  bool skip() override { return bi->getRuleStatus() == UBRK_WORD_NONE; }
+  bool skip(int32_t, int32_t) override;
+  void new_text() override { chars_ready = false; }
+  std::unique_ptr<splitter> clone() const override {
+    return std::make_unique<wordbreak_splitter>(*this);
+  }
 
 public:
-  wordbreak_splitter(icu::Locale &loc, const icu::UnicodeString &delim_, output mode_);
+  wordbreak_splitter(icu::Locale &loc, const icu::UnicodeString &delim_,
+                     output mode_, const word_filter &filter_);
+  wordbreak_splitter(const wordbreak_splitter &other)
+      : break_splitter(other), filter(other.filter),
+        chars(other.chars ? other.chars->clone() : nullptr),
+        chars_ready(false) {}
   ~wordbreak_splitter() override {}
 };
 
 wordbreak_splitter::wordbreak_splitter(icu::Locale &loc,
                                        const icu::UnicodeString &delim_,
-                                       output mode_)
-    : break_splitter(delim_, mode_) {
+                                       output mode_,
+                                       const word_filter &filter_)
+    : break_splitter(delim_, mode_), filter(filter_) {
   UErrorCode err = U_ZERO_ERROR;
   bi = std::unique_ptr<icu::BreakIterator>(
       icu::BreakIterator::createWordInstance(loc, err));
@@ -271,25 +1405,109 @@ wordbreak_splitter::wordbreak_splitter(icu::Locale &loc,
     throw std::runtime_error{"Unable to create word iterator: "s +
                              u_errorName(err)};
   }
+  if (filter.min_length > 1 || filter.max_length < INT32_MAX) {
+    chars = std::unique_ptr<icu::BreakIterator>(
+        icu::BreakIterator::createCharacterInstance(loc, err));
+    if (U_FAILURE(err)) {
+      throw std::runtime_error{"Unable to create iterator: "s +
+                               u_errorName(err)};
+    }
+  }
+}
+
+// Decided from the rule status of the word's end boundary, and its
+// length, before anything is done with the word's text.
+bool wordbreak_splitter::skip(int32_t start, int32_t end) {
+  int32_t status = bi->getRuleStatus();
+  if (status < UBRK_WORD_NONE_LIMIT) {
+    return true;
+  }
+  if (filter.kinds && status < UBRK_WORD_IDEO_LIMIT &&
+      !(filter.kinds & (1U << (status / 100)))) {
+    return true;
+  }
+  return chars && !length_ok(start, end);
+}
+
+// Whether the word between two offsets has an allowed number of
+// characters. Each one is at least one code unit (Or byte), so that
+// usually settles it without counting.
+bool wordbreak_splitter::length_ok(int32_t start, int32_t end) {
+  if (end - start < filter.min_length) {
+    return false;
+  }
+  if (end - start <= filter.max_length && filter.min_length <= 1) {
+    return true;
+  }
+
+  if (!chars_ready) {
+    UErrorCode err = U_ZERO_ERROR;
+    UText ut = UTEXT_INITIALIZER;
+    chars->setText(bi->getUText(&ut, err), err);
+    utext_close(&ut);
+    if (U_FAILURE(err)) {
+      throw std::runtime_error{"Unable to count characters: "s +
+                               u_errorName(err)};
+    }
+    chars_ready = true;
+  }
+  // The end of the word ends its last character, even where that's
+  // part of a longer cluster in the surrounding text.
+  int32_t n = 1;
+  for (auto pos = chars->following(start);
+       pos != icu::BreakIterator::DONE && pos < end; pos = chars->next()) {
+    n += 1;
+    if (n > filter.max_length) {
+      return false;
+    }
+  }
+  return n >= filter.min_length && n <= filter.max_length;
 }
 
 std::unique_ptr<splitter> make_splitter(split_at which, icu::Locale &loc,
                                         const icu::UnicodeString &delim,
-                                        output mode) {
+                                        output mode,
+                                        const word_filter &filter) {
   switch (which) {
   case split_at::CP:
     return std::make_unique<cp_splitter>(delim, mode);
   case split_at::WORD:
-    return std::make_unique<wordbreak_splitter>(loc, delim, mode);
+    return std::make_unique<wordbreak_splitter>(loc, delim, mode, filter);
   case split_at::CHAR:
     return std::make_unique<charbreak_splitter>(loc, delim, mode);
   case split_at::SENTENCE:
-    return std::make_unique<break_splitter>(which, loc, delim, mode);
+    return std::make_unique<sentence_splitter>(loc, delim, mode);
   default:
     throw std::runtime_error{"Unknown splitter type"};
   }
 }
 
+// Parse a comma separated list of word types for --only into a
+// word_filter's kinds. Returns false if there's an unknown one.
+bool parse_word_kinds(const char *arg, unsigned int &kinds) {
+  static const struct {
+    const char *name;
+    int32_t status;
+  } types[] = {{"number", UBRK_WORD_NUMBER},
+               {"letter", UBRK_WORD_LETTER},
+               {"kana", UBRK_WORD_KANA},
+               {"ideo", UBRK_WORD_IDEO}};
+  std::string list{arg};
+  std::size_t pos = 0;
+  do {
+    std::size_t comma = std::min(list.find(',', pos), list.size());
+    std::string name = list.substr(pos, comma - pos);
+    auto type = std::find_if(std::begin(types), std::end(types),
+                             [&](const auto &t) { return name == t.name; });
+    if (type == std::end(types)) {
+      return false;
+    }
+    kinds |= 1U << (type->status / 100);
+    pos = comma + 1;
+  } while (pos <= list.size());
+  return true;
+}
+
 void print_usage(const char *progname) {
   std::cout << "Usage: " << progname << "[OPTIONS] SPLIT-TYPE [FILE ...]\n";
   std::cout << R"(
@@ -311,6 +1529,14 @@ Other options (Mandatory arguments for long options are mandatory for short ones
   -d, --delimiter=STRING: Print STRING between tokens. Defaults to newline. Understands standard backslash escape sequences.
   -z, --zero: Use a null byte as the delimiter.
   -j, --json: Output JSON arrays of strings (Number for --codepoints).
+  -t, --threads=N: Split large UTF-8 files using N threads.
+  --offsets=FORMAT: Write the byte offsets of each token instead of the token.
+    FORMAT is text, binary (64 bit integers) or binary32.
+  --rule-status: Include the rule status of each token with --offsets.
+  --only=TYPES: Only keep words of the given comma separated types: number,
+    letter, kana or ideo.
+  --min-length=N, --max-length=N: Only keep words with at least or at most N
+    characters.
 )";
 }
 
@@ -320,13 +1546,21 @@ int main(int argc, char **argv) {
       {"codepoints", 0, nullptr, 'c'}, {"chars", 0, nullptr, 'm'},
       {"sentences", 0, nullptr, 's'},  {"words", 0, nullptr, 'w'},
       {"delimiter", 1, nullptr, 'd'},  {"zero", 0, nullptr, 'z'},
-      {"json", 0, nullptr, 'j'},       {nullptr, 0, nullptr, 0}};
+      {"json", 0, nullptr, 'j'},       {"threads", 1, nullptr, 't'},
+      {"offsets", 1, nullptr, 1},      {"rule-status", 0, nullptr, 2},
+      {"only", 1, nullptr, 3},         {"min-length", 1, nullptr, 4},
+      {"max-length", 1, nullptr, 5},   {nullptr, 0, nullptr, 0}};
   auto which = split_at::UNSPEC;
   icu::UnicodeString delim{u"\n"};
   auto mode = output::TEXT;
+  unsigned int nthreads = 1;
+  auto offset_format = offsets::NONE;
+  bool rule_status = false;
+  word_filter filter;
+  bool filtered = false;
 
   for (int val;
-       (val = getopt_long(argc, argv, "vhcmswd:zj", opts, nullptr)) != -1;) {
+       (val = getopt_long(argc, argv, "vhcmswd:zjt:", opts, nullptr)) != -1;) {
     switch (val) {
     case 'v':
       std::cout << argv[0] << " version " << version << '\n';
@@ -355,6 +1589,55 @@ int main(int argc, char **argv) {
     case 'j':
       mode = output::JSON;
       break;
+    case 't':
+      nthreads = std::strtoul(optarg, nullptr, 10);
+      if (nthreads == 0) {
+        std::cerr << argv[0] << ": invalid number of threads '" << optarg
+                  << "'\n";
+        return 1;
+      }
+      break;
+    case 1:
+      if (std::strcmp(optarg, "text") == 0) {
+        offset_format = offsets::TEXT;
+      } else if (std::strcmp(optarg, "binary") == 0 ||
+                 std::strcmp(optarg, "binary64") == 0) {
+        offset_format = offsets::BINARY64;
+      } else if (std::strcmp(optarg, "binary32") == 0) {
+        offset_format = offsets::BINARY32;
+      } else {
+        std::cerr << argv[0] << ": unknown --offsets format '" << optarg
+                  << "'\n";
+        return 1;
+      }
+      break;
+    case 2:
+      rule_status = true;
+      break;
+    case 3:
+      filtered = true;
+      if (!parse_word_kinds(optarg, filter.kinds)) {
+        std::cerr << argv[0] << ": unknown word type in '" << optarg
+                  << "'\n";
+        return 1;
+      }
+      break;
+    case 4:
+    case 5: {
+      filtered = true;
+      char *end;
+      long n = std::strtol(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || n < 0 || n > INT32_MAX) {
+        std::cerr << argv[0] << ": invalid length '" << optarg << "'\n";
+        return 1;
+      }
+      if (val == 4) {
+        filter.min_length = n;
+      } else {
+        filter.max_length = n;
+      }
+      break;
+    }
     default:
       return 1;
     }
@@ -364,17 +1647,49 @@ int main(int argc, char **argv) {
     std::cerr << argv[0] << ": missing split type argument.\n";
     return 1;
   }
+  if (offset_format != offsets::NONE && mode == output::JSON) {
+    std::cerr << argv[0] << ": --offsets can't be used with --json.\n";
+    return 1;
+  }
+  if (filtered && which != split_at::WORD) {
+    std::cerr << argv[0]
+              << ": --only, --min-length and --max-length need --words.\n";
+    return 1;
+  }
+  if (rule_status && offset_format == offsets::NONE) {
+    std::cerr << argv[0] << ": --rule-status needs --offsets.\n";
+    return 1;
+  }
+  // Nothing in binary output shows where one file's offsets end.
+  if ((offset_format == offsets::BINARY32 ||
+       offset_format == offsets::BINARY64) &&
+      argc - optind > 1) {
+    std::cerr << argv[0]
+              << ": binary --offsets can only be used with one file.\n";
+    return 1;
+  }
 
   try {
     icu::Locale loc;
-    auto splitter = make_splitter(which, loc, delim, mode);
+    auto splitter = make_splitter(which, loc, delim, mode, filter);
+    std::unique_ptr<offset_writer> offset_out;
+    if (offset_format != offsets::NONE) {
+      offset_out.reset(new offset_writer(offset_format, rule_status));
+    }
+    auto split = [&](UFILE *uf) {
+      if (offset_out) {
+        splitter->split_offsets(uf, *offset_out);
+      } else if (!splitter->split_threaded(uf, nthreads)) {
+        splitter->split(uf);
+      }
+    };
 
     if (optind == argc) {
       ufp ustdin{u_fadopt(stdin, nullptr, nullptr), &u_fclose};
       if (!ustdin) {
         throw std::runtime_error{"Unable to read from standard input"};
       }
-      splitter->split(ustdin.get());
+      split(ustdin.get());
     } else {
       for (int i = optind; i < argc; i += 1) {
         try {
@@ -389,7 +1704,7 @@ int main(int argc, char **argv) {
           if (!uf) {
             throw std::invalid_argument{argv[i]};
           }
-          splitter->split(uf.get());
+          split(uf.get());
         } catch (std::invalid_argument &) {
           std::cerr << argv[0] << ": unable to open '" << argv[i] << "'\n";
         }
@@ -33,7 +33,7 @@
 // Return the number of fixed-width columns taken up by a unicode codepoint
 // Inspired by https://www.cl.cam.ac.uk/~mgk25/ucs/wcwidth.c
 int uu::unicwidth(UChar32 c) {
-  static std::unordered_map<UChar32, int> cache;
+  static thread_local std::unordered_map<UChar32, int> cache;
 
   auto it = cache.find(c);
   if (it != cache.end()) {
@@ -84,7 +84,7 @@ int uu::unicwidth(UChar32 c) {
 int uu::unicswidth(const icu::UnicodeString &s) {
   auto iter = icu::StringCharacterIterator{s};
   int width = 0;
-  for (UChar32 c = iter.first32PostInc(); c != StringCharacterIterator::DONE;
+  for (UChar32 c = iter.first32PostInc(); c != icu::StringCharacterIterator::DONE;
        c = iter.next32PostInc()) {
     width += uu::unicwidth(c);
   }
@@ -22,16 +22,45 @@
  */
 
 #include <iostream>
+#include <fstream>
 #include <stdexcept>
 #include <memory>
 #include <algorithm>
+#include <string>
+#include <map>
+#include <deque>
+#include <queue>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <exception>
+#include <cerrno>
+#include <cmath>
 #include <cstring>
+#include <cstdint>
+#include <climits>
 
 #include <unicode/unistr.h>
 #include <unicode/ustdio.h>
 #include <unicode/brkiter.h>
 #include <unicode/locid.h>
+#include <unicode/ucnv.h>
+#include <unicode/ustring.h>
+#include <unicode/utf8.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <getopt.h>
 
 #include "json.hpp"
@@ -47,58 +76,91 @@ enum wanted_stats {
   WC_CHAR = 0x2,
   WC_WORD = 0x4,
   WC_NL = 0x8,
-  WC_LEN = 0x10,
-  WC_PRINT = 0x20
+  WC_LEN = 0x10
+};
+
+enum class output { TEXT, JSON, NDJSON };
+
+// Half-widths of the confidence intervals of estimated counts. A
+// confidence of 0 means the counts are exact.
+struct margins {
+  double confidence;
+  double cp, chars, word, nl;
+  margins() : confidence(0), cp(0), chars(0), word(0), nl(0) {}
 };
 
 struct counts {
   unsigned int flags;
-  unsigned int cp, chars, word, nl, len;
+  std::uint64_t cp, chars, word, nl, len;
+  struct margins err;
   counts() : flags(0), cp(0), chars(0), word(0), nl(0), len(0) {}
   counts(unsigned int flags_)
       : flags(flags_), cp(0), chars(0), word(0), nl(0), len(0) {}
+  counts &operator+=(const counts &c) {
+    cp += c.cp;
+    chars += c.chars;
+    word += c.word;
+    nl += c.nl;
+    len = std::max(len, c.len);
+    // Samples of different files are independent, so the margins add in
+    // quadrature.
+    err.confidence = std::max(err.confidence, c.err.confidence);
+    err.cp = std::hypot(err.cp, c.err.cp);
+    err.chars = std::hypot(err.chars, c.err.chars);
+    err.word = std::hypot(err.word, c.err.word);
+    err.nl = std::hypot(err.nl, c.err.nl);
+    return *this;
+  }
 };
 
 std::ostream &operator<<(std::ostream &os, const struct counts &c) {
   bool first = true;
-  if (c.flags & WC_NL) {
-    os << c.nl;
-    first = false;
-  }
-  if (c.flags & WC_WORD) {
+  auto field = [&](std::uint64_t n, double err) {
     if (!first) {
       os << '\t';
     }
-    os << c.word;
+    os << n;
+    if (c.err.confidence > 0) {
+      os << "±" << std::llround(err);
+    }
     first = false;
+  };
+  if (c.flags & WC_NL) {
+    field(c.nl, c.err.nl);
+  }
+  if (c.flags & WC_WORD) {
+    field(c.word, c.err.word);
   }
   if (c.flags & WC_CHAR) {
-    if (!first) {
-      os << '\t';
-    }
-    os << c.chars;
-    first = false;
+    field(c.chars, c.err.chars);
   }
   if (c.flags & WC_CP) {
-    if (!first) {
-      os << '\t';
-    }
-    os << c.cp;
-    first = false;
+    field(c.cp, c.err.cp);
   }
   if (c.flags & WC_LEN) {
     if (!first) {
       os << '\t';
     }
     os << c.len;
-    first = false;
   }
   return os;
 }
 
-nlohmann::json counts_to_json(const char *filename, const struct counts &c) {
+// Lower and upper bounds of the confidence interval around an estimate.
+std::pair<std::uint64_t, std::uint64_t> interval(std::uint64_t n,
+                                                  double err) {
+  auto margin = static_cast<std::uint64_t>(std::ceil(err));
+  return {n > margin ? n - margin : 0, n + margin};
+}
+
+nlohmann::json counts_to_json(const char *filename, const struct counts &c,
+                              const char *key = "filename") {
   nlohmann::json res;
-  res["filename"] = filename;
+  if (filename) {
+    res[key] = filename;
+  } else {
+    res[key] = nullptr;
+  }
   if (c.flags & WC_CP) {
     res["codepoints"] = c.cp;
   }
@@ -114,18 +176,129 @@ nlohmann::json counts_to_json(const char *filename, const struct counts &c) {
   if (c.flags & WC_LEN) {
     res["max-line-length"] = c.len;
   }
+  if (c.err.confidence > 0) {
+    nlohmann::json intervals;
+    auto add = [&](const char *name, std::uint64_t n, double err) {
+      auto lh = interval(n, err);
+      intervals[name] = {lh.first, lh.second};
+    };
+    if (c.flags & WC_CP) {
+      add("codepoints", c.cp, c.err.cp);
+    }
+    if (c.flags & WC_CHAR) {
+      add("characters", c.chars, c.err.chars);
+    }
+    if (c.flags & WC_WORD) {
+      add("words", c.word, c.err.word);
+    }
+    if (c.flags & WC_NL) {
+      add("newlines", c.nl, c.err.nl);
+    }
+    res["confidence"] = c.err.confidence;
+    res["intervals"] = intervals;
+  }
   return res;
 }
 
-nlohmann::json count(UFILE *uf, const char *filename, unsigned int flags,
-                     struct counts &total_counts, const icu::Locale &loc) {
-  struct counts counts(flags);
+// Write a JSON string literal without going through nlohmann::json.
+// Invalid UTF-8 in the input is replaced with U+FFFD.
+void print_json_string(std::ostream &os, const char *s) {
+  static const char hex[] = "0123456789abcdef";
+  const auto *bytes = reinterpret_cast<const uint8_t *>(s);
+  int32_t len = std::strlen(s);
+
+  os << '"';
+  for (int32_t i = 0; i < len;) {
+    int32_t start = i;
+    UChar32 c;
+    U8_NEXT(bytes, i, len, c);
+    if (c < 0) {
+      os << "\\ufffd";
+    } else if (c == '"' || c == '\\') {
+      os << '\\' << static_cast<char>(c);
+    } else if (c < 0x20) {
+      os << "\\u00" << hex[c >> 4] << hex[c & 0xF];
+    } else {
+      os.write(s + start, i - start);
+    }
+  }
+  os << '"';
+}
+
+void print_ndjson_counts(std::ostream &os, const struct counts &c) {
+  if (c.flags & WC_NL) {
+    os << ",\"newlines\":" << c.nl;
+  }
+  if (c.flags & WC_WORD) {
+    os << ",\"words\":" << c.word;
+  }
+  if (c.flags & WC_CHAR) {
+    os << ",\"characters\":" << c.chars;
+  }
+  if (c.flags & WC_CP) {
+    os << ",\"codepoints\":" << c.cp;
+  }
+  if (c.flags & WC_LEN) {
+    os << ",\"max-line-length\":" << c.len;
+  }
+  if (c.err.confidence > 0) {
+    const char *sep = "";
+    auto add = [&](const char *name, std::uint64_t n, double err) {
+      auto lh = interval(n, err);
+      os << sep << '"' << name << "\":[" << lh.first << ',' << lh.second
+         << ']';
+      sep = ",";
+    };
+    os << ",\"confidence\":" << c.err.confidence << ",\"intervals\":{";
+    if (c.flags & WC_NL) {
+      add("newlines", c.nl, c.err.nl);
+    }
+    if (c.flags & WC_WORD) {
+      add("words", c.word, c.err.word);
+    }
+    if (c.flags & WC_CHAR) {
+      add("characters", c.chars, c.err.chars);
+    }
+    if (c.flags & WC_CP) {
+      add("codepoints", c.cp, c.err.cp);
+    }
+    os << '}';
+  }
+}
+
+// One compact object per line, flushed as soon as it's written so
+// consumers see results while the rest of the files are still being
+// counted.
+void print_ndjson(std::ostream &os, const char *filename,
+                  const struct counts &c, const char *key = "filename") {
+  os << "{\"" << key << "\":";
+  if (filename) {
+    print_json_string(os, filename);
+  } else {
+    os << "null";
+  }
+  print_ndjson_counts(os, c);
+  os << "}\n" << std::flush;
+}
+
+void print_ndjson_total(std::ostream &os, std::uint64_t nfiles,
+                        const struct counts &c) {
+  os << "{\"total\":true,\"files\":" << nfiles;
+  print_ndjson_counts(os, c);
+  os << "}\n" << std::flush;
+}
+
+// The break iterators used to count one file.
+struct iterators {
+  std::unique_ptr<icu::BreakIterator> word, chars;
+  iterators(unsigned int flags, const icu::Locale &loc);
+};
+
+iterators::iterators(unsigned int flags, const icu::Locale &loc) {
   UErrorCode err = U_ZERO_ERROR;
-  icu::UnicodeString line;
-  std::unique_ptr<icu::BreakIterator> wit, cit;
 
   if (flags & WC_WORD) {
-    wit = std::unique_ptr<icu::BreakIterator>{
+    word = std::unique_ptr<icu::BreakIterator>{
         icu::BreakIterator::createWordInstance(loc, err)};
     if (U_FAILURE(err)) {
       throw std::runtime_error{"Unable to create word break iterator: "s +
@@ -134,62 +307,799 @@ nlohmann::json count(UFILE *uf, const char *filename, unsigned int flags,
   }
 
   if (flags & WC_CHAR) {
-    cit = std::unique_ptr<icu::BreakIterator>{
+    chars = std::unique_ptr<icu::BreakIterator>{
         icu::BreakIterator::createCharacterInstance(loc, err)};
     if (U_FAILURE(err)) {
       throw std::runtime_error{"Unable to create character break iterator: "s +
                                u_errorName(err)};
     }
   }
+}
 
-  while (uu::getline(uf, &line, true, true)) {
-    if (flags & WC_CP) {
-      auto cps = line.countChar32();
-      counts.cp += cps;
-      total_counts.cp += cps;
+// Count a line, or the end of one whose start was already counted by
+// count_piece(). width is the display width of that start.
+void count_line(const icu::UnicodeString &line, iterators &its,
+                struct counts &counts, std::uint64_t width = 0) {
+  auto flags = counts.flags;
+
+  if (flags & WC_CP) {
+    auto cps = line.countChar32();
+    counts.cp += cps;
+  }
+
+  if (flags & WC_NL && line.endsWith(u"\n", 0, 1)) {
+    counts.nl += 1;
+  }
+
+  if (flags & WC_LEN) {
+    std::uint64_t len = width + uu::unicswidth(line);
+    counts.len = std::max(counts.len, len);
+  }
+
+  if (flags & WC_WORD) {
+    its.word->setText(line);
+    for (auto pos = its.word->first(); pos != icu::BreakIterator::DONE;
+         pos = its.word->next()) {
+      if (its.word->getRuleStatus() != UBRK_WORD_NONE) {
+        counts.word += 1;
+      }
+    }
+  }
+
+  if (flags & WC_CHAR) {
+    its.chars->setText(line);
+    its.chars->first();
+    while (its.chars->next() != icu::BreakIterator::DONE) {
+      counts.chars += 1;
+    }
+  }
+}
+
+// Lines longer than this many code units are counted a piece at a
+// time, so memory use doesn't depend on line length, and a line can be
+// longer than a UnicodeString.
+constexpr int32_t max_piece = 1024 * 1024;
+
+// The longest unfinished line that count_piece() keeps without finding
+// anywhere to cut it.
+constexpr int32_t max_unfinished = INT32_MAX / 2;
+
+// Count the start of an unfinished line, up to a point that the rest
+// of the line can't change, and remove it from line. width is the
+// display width of what's been counted so far. Character boundaries are
+// final once another character follows them. Word boundaries are only
+// known to be final before a space, so with --words a piece ends before
+// the last run of spaces, and nothing is counted if there isn't one.
+void count_piece(icu::UnicodeString &line, iterators &its,
+                 struct counts &counts, std::uint64_t &width) {
+  auto flags = counts.flags;
+  int32_t cut = line.length();
+  if (cut > 0 && U16_IS_LEAD(line[cut - 1])) {
+    cut -= 1;
+  }
+
+  if (flags & WC_WORD) {
+    its.word->setText(line);
+    cut = line.lastIndexOf(u' ', 0, cut);
+    while (cut > 0 && line[cut - 1] == u' ') {
+      cut -= 1;
+    }
+    if (cut <= 0 || !its.word->isBoundary(cut)) {
+      cut = 0;
+    }
+  }
+  if (flags & WC_CHAR) {
+    its.chars->setText(line);
+    if (!(flags & WC_WORD)) {
+      cut = std::max(its.chars->preceding(cut), 0);
+    } else if (cut > 0 && !its.chars->isBoundary(cut)) {
+      cut = 0;
+    }
+  }
+
+  if (cut == 0) {
+    if (line.length() > max_unfinished) {
+      throw std::runtime_error{
+          "Line too long to count words in without a space"};
+    }
+    return;
+  }
+
+  if (flags & WC_CP) {
+    counts.cp += line.countChar32(0, cut);
+  }
+  if (flags & WC_LEN) {
+    width += uu::unicswidth(line.tempSubString(0, cut));
+  }
+  if (flags & WC_WORD) {
+    its.word->first();
+    for (auto pos = its.word->next(); pos != icu::BreakIterator::DONE &&
+                                      pos <= cut;
+         pos = its.word->next()) {
+      if (its.word->getRuleStatus() != UBRK_WORD_NONE) {
+        counts.word += 1;
+      }
     }
+  }
+  if (flags & WC_CHAR) {
+    its.chars->first();
+    for (auto pos = its.chars->next();
+         pos != icu::BreakIterator::DONE && pos <= cut;
+         pos = its.chars->next()) {
+      counts.chars += 1;
+    }
+  }
+  line.remove(0, cut);
+}
 
-    if (flags & WC_NL && line.endsWith(u"\n", 0, 1)) {
-      counts.nl += 1;
-      total_counts.nl += 1;
+struct counts count(UFILE *uf, unsigned int flags, iterators &its) {
+  struct counts counts(flags);
+  icu::UnicodeString line;
+  UChar buffer[4096];
+  std::uint64_t width = 0;
+  int32_t piece_at = max_piece;
+
+  // Like uu::getline(), but a long line is counted as it's read. The
+  // text is read in blocks and split on newlines here rather than with
+  // u_fgets(), which can't say how much it read if a line has a NUL.
+  int32_t n;
+  while ((n = u_file_read(buffer, 4096, uf)) > 0) {
+    const UChar *p = buffer, *end = buffer + n;
+    while (p < end) {
+      const UChar *nl = u_memchr(p, u'\n', end - p);
+      const UChar *stop = nl ? nl + 1 : end;
+      line.append(p, stop - p);
+      p = stop;
+      if (nl) {
+        count_line(line, its, counts, width);
+        line.remove();
+        width = 0;
+        piece_at = max_piece;
+      } else if (line.length() >= piece_at) {
+        count_piece(line, its, counts, width);
+        // If little could be cut, wait for the line to double before
+        // trying again, so it's still scanned in linear time.
+        piece_at = std::max(max_piece, 2 * line.length());
+      }
     }
+  }
+  if (!line.isEmpty()) {
+    count_line(line, its, counts, width);
+  }
+
+  return counts;
+}
 
-    if (flags & WC_LEN) {
-      unsigned int len = uu::unicswidth(line);
-      counts.len = std::max(counts.len, len);
-      total_counts.len = std::max(total_counts.len, len);
+class file_wrapper {
+private:
+  int fd;
+
+public:
+  file_wrapper(int fd_) : fd(fd_) {}
+  ~file_wrapper() noexcept {
+    if (fd > STDERR_FILENO) {
+      close(fd);
     }
+  }
+  operator int() const noexcept { return fd; }
+};
+
+struct estimate_options {
+  double confidence; // 0 means count everything.
+  double time_limit; // Seconds per file.
+  estimate_options() : confidence(0), time_limit(10) {}
+};
+
+// --estimate samples blocks of this size,
+constexpr off_t estimate_block = 64 * 1024;
+// at least this many of them,
+constexpr std::uint64_t estimate_min_samples = 32;
+// until every interval is within this fraction of its estimate.
+constexpr double estimate_precision = 0.01;
+
+// Inverse of the standard normal CDF, using Peter Acklam's rational
+// approximation (Relative error less than 1.15e-9).
+double normal_quantile(double p) {
+  static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02,
+                             -2.759285104469687e+02, 1.383577518672690e+02,
+                             -3.066479806614716e+01, 2.506628277459239e+00};
+  static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02,
+                             -1.556989798598866e+02, 6.680131188771972e+01,
+                             -1.328068155288572e+01};
+  static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01,
+                             -2.400758277161838e+00, -2.549671010229528e+00,
+                             4.374664141464968e+00,  2.938163982698783e+00};
+  static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01,
+                             2.445134137142996e+00, 3.754408661907416e+00};
+  const double p_low = 0.02425;
 
-    if (flags & WC_WORD) {
-      wit->setText(line);
-      for (auto pos = wit->first(); pos != icu::BreakIterator::DONE;
-           pos = wit->next()) {
-        if (wit->getRuleStatus() != UBRK_WORD_NONE) {
-          counts.word += 1;
-          total_counts.word += 1;
+  if (p < p_low) {
+    double q = std::sqrt(-2 * std::log(p));
+    return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q +
+            c[5]) /
+           ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+  } else if (p <= 1 - p_low) {
+    double q = p - 0.5;
+    double r = q * q;
+    return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r +
+            a[5]) *
+           q /
+           (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+  } else {
+    return -normal_quantile(1 - p);
+  }
+}
+
+// The quantile of Student's t distribution with df degrees of freedom
+// matching the standard normal quantile z, using the first terms of
+// its Cornish-Fisher expansion; close enough for the sample sizes
+// estimate() stops at.
+double t_quantile(double z, double df) {
+  double z2 = z * z;
+  return z + z * (z2 + 1) / (4 * df) +
+         z * ((5 * z2 + 16) * z2 + 3) / (96 * df * df);
+}
+
+// Estimate the counts of a large regular file by counting a random
+// sample of its blocks, instead of reading all of it. Each block owns
+// the lines that start inside it, so the blocks partition the file.
+// Blocks own different amounts of text, so each total is estimated as
+// the count per byte of the sampled blocks times the bytes in all of
+// them (a ratio estimator), with the margin from how far each sample
+// is from that rate. Only whole blocks are sampled; the partial block
+// at the end is always counted exactly and added on. The maximum line
+// length can't be estimated, and is just the longest line seen.
+//
+// Returns false if the file can't be mapped; the caller should count it
+// the normal way instead.
+bool estimate(const char *filename, unsigned int flags, iterators &its,
+              const estimate_options &opts, struct counts &result) {
+  if (std::strcmp(filename, "/dev/stdin") == 0 ||
+      std::strcmp(filename, "-") == 0) {
+    return false;
+  }
+
+  file_wrapper fd{open(filename, O_RDONLY | O_CLOEXEC)};
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat s;
+  if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size == 0) {
+    return false;
+  }
+
+  auto free_mmap = [&s](void *mem) {
+    if (mem != MAP_FAILED) {
+      munmap(mem, s.st_size);
+    }
+  };
+  std::unique_ptr<void, decltype(free_mmap)> mem(
+      mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0), free_mmap);
+  if (mem.get() == MAP_FAILED) {
+    return false;
+  }
+  madvise(mem.get(), s.st_size, MADV_RANDOM);
+
+  const char *data = static_cast<const char *>(mem.get());
+  const off_t size = s.st_size;
+  const std::uint64_t nblocks = size / estimate_block;
+
+  UErrorCode err = U_ZERO_ERROR;
+  std::unique_ptr<UConverter, decltype(&ucnv_close)> conv{
+      ucnv_open(nullptr, &err), &ucnv_close};
+  if (U_FAILURE(err)) {
+    throw std::runtime_error{"Unable to open converter: "s +
+                             u_errorName(err)};
+  }
+
+  auto line_start = [&](off_t pos) -> off_t {
+    if (pos == 0 || pos >= size) {
+      return std::min(pos, size);
+    }
+    auto nl = static_cast<const char *>(
+        std::memchr(data + pos - 1, '\n', size - pos + 1));
+    return nl ? nl - data + 1 : size;
+  };
+
+  // Count the lines between two offsets. A long line is converted and
+  // counted a piece at a time, the same as count() does.
+  icu::UnicodeString line;
+  UChar buffer[4096];
+  auto count_lines = [&](off_t start, off_t end, struct counts &c) {
+    while (start < end) {
+      auto nl = static_cast<const char *>(
+          std::memchr(data + start, '\n', end - start));
+      const char *p = data + start;
+      const char *limit = nl ? nl + 1 : data + end;
+      std::uint64_t width = 0;
+      int32_t piece_at = max_piece;
+      line.remove();
+      ucnv_resetToUnicode(conv.get());
+      for (;;) {
+        UChar *target = buffer;
+        ucnv_toUnicode(conv.get(), &target, buffer + 4096, &p, limit,
+                       nullptr, true, &err);
+        line.append(buffer, target - buffer);
+        if (err != U_BUFFER_OVERFLOW_ERROR) {
+          break;
+        }
+        err = U_ZERO_ERROR;
+        if (line.length() >= piece_at) {
+          count_piece(line, its, c, width);
+          piece_at = std::max(max_piece, 2 * line.length());
         }
       }
+      if (U_FAILURE(err)) {
+        throw std::runtime_error{"Unable to convert text: "s +
+                                 u_errorName(err)};
+      }
+      count_line(line, its, c, width);
+      start = limit - data;
+    }
+  };
+
+  // Fisher-Yates shuffle of the block numbers, only remembering the
+  // entries that have been swapped.
+  std::mt19937_64 rng{std::random_device{}()};
+  std::unordered_map<std::uint64_t, std::uint64_t> swapped;
+  auto block_at = [&](std::uint64_t i) {
+    auto it = swapped.find(i);
+    return it == swapped.end() ? i : it->second;
+  };
+  auto next_block = [&](std::uint64_t i) {
+    std::uniform_int_distribution<std::uint64_t> dist(i, nblocks - 1);
+    auto j = dist(rng);
+    auto b = block_at(j);
+    swapped[j] = block_at(i);
+    return b;
+  };
+
+  result = counts(flags);
+  const off_t sampled_bytes = line_start(nblocks * estimate_block);
+  struct counts tail(flags);
+  count_lines(sampled_bytes, size, tail);
+  result.len = tail.len;
+
+  // Running sums over the samples of each count y and the bytes x of
+  // each block, for the rate and its variance.
+  enum { CP, CHAR, WORD, NL, NSTATS };
+  double sum_x = 0, sum_xx = 0;
+  double sum_y[NSTATS] = {0}, sum_yy[NSTATS] = {0}, sum_xy[NSTATS] = {0};
+  const unsigned int stat_flags[NSTATS] = {WC_CP, WC_CHAR, WC_WORD, WC_NL};
+  const double z = normal_quantile(1 - (1 - opts.confidence) / 2);
+  double est[NSTATS] = {0}, margin[NSTATS] = {0};
+  auto deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(opts.time_limit));
+  std::uint64_t n = 0;
+
+  while (n < nblocks) {
+    auto b = next_block(n);
+    off_t start = line_start(b * estimate_block);
+    off_t end = line_start((b + 1) * estimate_block);
+    struct counts sample(flags);
+    count_lines(start, end, sample);
+
+    const double x = end - start;
+    const std::uint64_t values[NSTATS] = {sample.cp, sample.chars,
+                                          sample.word, sample.nl};
+    sum_x += x;
+    sum_xx += x * x;
+    for (int i = 0; i < NSTATS; i += 1) {
+      sum_y[i] += values[i];
+      sum_yy[i] += static_cast<double>(values[i]) * values[i];
+      sum_xy[i] += x * values[i];
     }
+    result.len = std::max(result.len, sample.len);
+    n += 1;
 
-    if (flags & WC_CHAR) {
-      cit->setText(line);
-      for (auto pos = cit->first(); pos != icu::BreakIterator::DONE;
-           pos = cit->next()) {
-        counts.chars += 1;
-        total_counts.chars += 1;
+    // Until a sample owns some text there's no rate to go by.
+    if (n < estimate_min_samples || sum_x == 0) {
+      continue;
+    }
+    bool precise = true;
+    const double fpc = 1 - static_cast<double>(n) / nblocks;
+    const double t = t_quantile(z, n - 1);
+    for (int i = 0; i < NSTATS; i += 1) {
+      double rate = sum_y[i] / sum_x;
+      double variance =
+          std::max(0.0, (sum_yy[i] - 2 * rate * sum_xy[i] +
+                         rate * rate * sum_xx) /
+                            (n - 1));
+      est[i] = rate * sampled_bytes;
+      margin[i] = t * nblocks * std::sqrt(fpc * variance / n);
+      if ((flags & stat_flags[i]) && margin[i] > estimate_precision * est[i]) {
+        precise = false;
       }
     }
+    if (precise || std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
   }
 
-  if (flags & WC_PRINT) {
-    std::cout << counts;
-    if (filename) {
-      std::cout << '\t' << filename;
+  if (n == nblocks) {
+    // Ended up reading everything, so the counts are exact.
+    result.cp = sum_y[CP] + tail.cp;
+    result.chars = sum_y[CHAR] + tail.chars;
+    result.word = sum_y[WORD] + tail.word;
+    result.nl = sum_y[NL] + tail.nl;
+  } else {
+    result.cp = std::llround(est[CP]) + tail.cp;
+    result.chars = std::llround(est[CHAR]) + tail.chars;
+    result.word = std::llround(est[WORD]) + tail.word;
+    result.nl = std::llround(est[NL]) + tail.nl;
+    result.err.confidence = opts.confidence;
+    result.err.cp = margin[CP];
+    result.err.chars = margin[CHAR];
+    result.err.word = margin[WORD];
+    result.err.nl = margin[NL];
+  }
+
+  return true;
+}
+
+// ICU reads a UFILE on descriptor 0 a line at a time with fgets(),
+// which drops whatever follows a NUL in the line, so standard input is
+// read through a duplicate of it instead.
+ufp open_stdin() {
+  int fd = dup(STDIN_FILENO);
+  if (fd < 0) {
+    return ufp{nullptr, &u_fclose};
+  }
+  FILE *f = fdopen(fd, "r");
+  if (!f) {
+    close(fd);
+    return ufp{nullptr, &u_fclose};
+  }
+  ufp uf{u_fadopt(f, nullptr, nullptr), &u_fclose};
+  if (!uf) {
+    fclose(f);
+  }
+  return uf;
+}
+
+ufp open_input(const char *filename) {
+  if (std::strcmp(filename, "/dev/stdin") == 0 ||
+      std::strcmp(filename, "-") == 0) {
+    return open_stdin();
+  } else {
+    return ufp{u_fopen(filename, "r", nullptr, nullptr), &u_fclose};
+  }
+}
+
+enum class grouping { NONE, DIR, EXT };
+
+// A file waiting to be counted, or a directory waiting to be walked,
+// along with the name of the group its counts are added to.
+struct work_item {
+  std::string path;
+  off_t size;
+  std::string group;
+  work_item() : size(0) {}
+  work_item(std::string path_, off_t size_, std::string group_)
+      : path(std::move(path_)), size(size_), group(std::move(group_)) {}
+  // Largest files come out of the priority queue first.
+  bool operator<(const work_item &w) const { return size < w.size; }
+};
+
+// Shared between the threads that walk directories and count files.
+// Directories are handed out before files so discovery stays ahead of
+// counting, and files are handed out largest first so one huge file
+// found late doesn't leave every other thread idle at the end.
+class work_queue {
+private:
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::priority_queue<work_item> files;
+  std::deque<work_item> dirs;
+  int busy; // Threads currently producing more work.
+
+public:
+  enum class task { FILE, DIR, DONE };
+  work_queue() : busy(0) {}
+  void start_producing() {
+    std::lock_guard<std::mutex> lock(mtx);
+    busy += 1;
+  }
+  void done_producing() {
+    std::lock_guard<std::mutex> lock(mtx);
+    busy -= 1;
+    cv.notify_all();
+  }
+  void push_file(work_item w) {
+    std::lock_guard<std::mutex> lock(mtx);
+    files.push(std::move(w));
+    cv.notify_one();
+  }
+  void push_dir(work_item w) {
+    std::lock_guard<std::mutex> lock(mtx);
+    dirs.push_back(std::move(w));
+    cv.notify_one();
+  }
+  // Popping a directory marks the caller as a producer until it calls
+  // done_producing().
+  task pop(work_item &);
+};
+
+work_queue::task work_queue::pop(work_item &w) {
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait(lock,
+          [this]() { return !dirs.empty() || !files.empty() || busy == 0; });
+  if (!dirs.empty()) {
+    w = std::move(dirs.front());
+    dirs.pop_front();
+    busy += 1;
+    return task::DIR;
+  } else if (!files.empty()) {
+    w = files.top();
+    files.pop();
+    return task::FILE;
+  } else {
+    return task::DONE;
+  }
+}
+
+std::string extension_group(const std::string &path) {
+  auto base = path.rfind('/');
+  base = base == std::string::npos ? 0 : base + 1;
+  auto dot = path.rfind('.');
+  // Dot files like .profile don't have an extension.
+  if (dot == std::string::npos || dot <= base) {
+    return "(no extension)";
+  }
+  return "*"s + path.substr(dot);
+}
+
+// The directory part of a path, like dirname(1).
+std::string dir_group(const std::string &path) {
+  auto end = path.find_last_not_of('/');
+  if (end == std::string::npos) {
+    return path.empty() ? "."s : "/"s;
+  }
+  auto slash = path.rfind('/', end);
+  if (slash == std::string::npos) {
+    return "."s;
+  }
+  end = path.find_last_not_of('/', slash);
+  return end == std::string::npos ? "/"s : path.substr(0, end + 1);
+}
+
+// Read one directory with getdents64, queueing its subdirectories and
+// regular files. Symbolic links found while walking are not followed.
+void walk_directory(const work_item &dir, work_queue &queue, grouping by,
+                    const std::function<void(const std::string &)> &error) {
+  file_wrapper fd{
+      openat(AT_FDCWD, dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (fd < 0) {
+    error("unable to read directory '"s + dir.path + "': " +
+          std::strerror(errno));
+    return;
+  }
+
+  alignas(struct dirent64) char buf[32768];
+  long nread;
+  std::string prefix = dir.path;
+  if (prefix.empty() || prefix.back() != '/') {
+    prefix += '/';
+  }
+
+  while ((nread = syscall(SYS_getdents64, int(fd), buf, sizeof buf)) > 0) {
+    for (long off = 0; off < nread;) {
+      auto *d = reinterpret_cast<struct dirent64 *>(buf + off);
+      off += d->d_reclen;
+      if (std::strcmp(d->d_name, ".") == 0 ||
+          std::strcmp(d->d_name, "..") == 0) {
+        continue;
+      }
+      std::string path = prefix + d->d_name;
+      struct stat st;
+      if (d->d_type == DT_DIR) {
+        st.st_mode = S_IFDIR;
+      } else if (d->d_type == DT_REG || d->d_type == DT_UNKNOWN) {
+        if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+          error("unable to open '"s + path + "'");
+          continue;
+        }
+      } else {
+        continue;
+      }
+      // With --group-by=dir, everything below a top level
+      // subdirectory of a command line directory shares its group.
+      if (S_ISDIR(st.st_mode)) {
+        std::string group = dir.group;
+        if (by == grouping::DIR && group.empty()) {
+          group = path;
+        }
+        queue.push_dir({std::move(path), 0, std::move(group)});
+      } else if (S_ISREG(st.st_mode)) {
+        std::string group = dir.group;
+        if (by == grouping::DIR && group.empty()) {
+          group = dir.path;
+        } else if (by == grouping::EXT) {
+          group = extension_group(path);
+        }
+        queue.push_file({std::move(path), st.st_size, std::move(group)});
+      }
     }
-    std::cout << '\n';
   }
+  if (nread < 0) {
+    error("unable to read directory '"s + dir.path + "': " +
+          std::strerror(errno));
+  }
+}
+
+// Counts many small files with a single pass of each break iterator
+// over one buffer holding all of them, so the per-file setup costs are
+// paid once per batch instead of once per file. Only files that end
+// in a newline are batched: the word and grapheme cluster rules always
+// break after one, so no word or character can span two files, and
+// each file's counts come out the same as counting it on its own.
+class batch {
+private:
+  std::string raw;
+  std::vector<std::size_t> ends;
+  std::vector<work_item> items;
+  icu::UnicodeString text;
+  std::unique_ptr<UConverter, decltype(&ucnv_close)> conv;
 
-  return counts_to_json(filename, counts);
+public:
+  static constexpr off_t max_file = 64 * 1024;
+  static constexpr std::size_t max_bytes = 1024 * 1024;
+  static constexpr std::size_t max_files = 4096;
+
+  batch();
+  bool empty() const noexcept { return items.empty(); }
+  bool full() const noexcept {
+    return raw.size() >= max_bytes || items.size() >= max_files;
+  }
+  // Returns false if the file isn't small enough to batch or doesn't
+  // end in a newline, and should be counted on its own.
+  bool add(const work_item &);
+  // Count and report every file in the batch, in the order they were
+  // added, and empty it.
+  void count(unsigned int flags, iterators &,
+             const std::function<void(const work_item &,
+                                      const struct counts &)> &report);
+};
+
+batch::batch() : conv(nullptr, &ucnv_close) {
+  UErrorCode err = U_ZERO_ERROR;
+  conv.reset(ucnv_open(nullptr, &err));
+  if (U_FAILURE(err)) {
+    throw std::runtime_error{"Unable to open converter: "s +
+                             u_errorName(err)};
+  }
+}
+
+bool batch::add(const work_item &w) {
+  if (w.path == "-" || w.path == "/dev/stdin") {
+    return false;
+  }
+
+  file_wrapper fd{open(w.path.c_str(), O_RDONLY | O_CLOEXEC)};
+  struct stat s;
+  if (fd < 0 || fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size == 0 ||
+      s.st_size > max_file) {
+    return false;
+  }
+
+  // Read one extra byte to notice files that grew since the stat.
+  auto start = raw.size();
+  raw.resize(start + s.st_size + 1);
+  std::size_t len = 0;
+  for (ssize_t n; len < raw.size() - start; len += n) {
+    n = read(fd, &raw[start + len], raw.size() - start - len);
+    if (n <= 0) {
+      break;
+    }
+  }
+  raw.resize(start + len);
+
+  if (len == 0 || len > static_cast<std::size_t>(s.st_size) ||
+      raw.back() != '\n') {
+    raw.resize(start);
+    return false;
+  }
+
+  ends.push_back(raw.size());
+  items.push_back(w);
+  return true;
+}
+
+void batch::count(
+    unsigned int flags, iterators &its,
+    const std::function<void(const work_item &, const struct counts &)>
+        &report) {
+  if (items.empty()) {
+    return;
+  }
+
+  // Convert each file separately so a converter error or a truncated
+  // multibyte sequence can't carry over into the next one. bounds[i] is
+  // the offset in text where file i ends.
+  std::vector<int32_t> bounds;
+  bounds.reserve(items.size());
+  UChar *buf = text.getBuffer(raw.size() * 2);
+  UChar *target = buf;
+  const char *source = raw.data();
+  for (auto end : ends) {
+    UErrorCode err = U_ZERO_ERROR;
+    ucnv_resetToUnicode(conv.get());
+    ucnv_toUnicode(conv.get(), &target, buf + text.getCapacity(), &source,
+                   raw.data() + end, nullptr, true, &err);
+    if (U_FAILURE(err)) {
+      text.releaseBuffer(0);
+      throw std::runtime_error{"Unable to convert text: "s +
+                               u_errorName(err)};
+    }
+    bounds.push_back(target - buf);
+  }
+  text.releaseBuffer(target - buf);
+
+  std::vector<struct counts> results(items.size(), counts(flags));
+
+  int32_t start = 0;
+  for (std::size_t i = 0; i < items.size(); i += 1) {
+    auto &c = results[i];
+    if (flags & WC_CP) {
+      c.cp = text.countChar32(start, bounds[i] - start);
+    }
+    if (flags & (WC_NL | WC_LEN)) {
+      for (int32_t line = start; line < bounds[i];) {
+        int32_t nl = text.indexOf(u'\n', line, bounds[i] - line);
+        if (flags & WC_LEN) {
+          std::uint64_t len =
+              uu::unicswidth(text.tempSubString(line, nl + 1 - line));
+          c.len = std::max(c.len, len);
+        }
+        if (flags & WC_NL) {
+          c.nl += 1;
+        }
+        line = nl + 1;
+      }
+    }
+    start = bounds[i];
+  }
+
+  // Every batched file ends with a newline, so each boundary belongs to
+  // the first file that ends at or after it.
+  if (flags & WC_WORD) {
+    its.word->setText(text);
+    its.word->first();
+    std::size_t f = 0;
+    for (auto pos = its.word->next(); pos != icu::BreakIterator::DONE;
+         pos = its.word->next()) {
+      while (pos > bounds[f]) {
+        f += 1;
+      }
+      if (its.word->getRuleStatus() != UBRK_WORD_NONE) {
+        results[f].word += 1;
+      }
+    }
+  }
+
+  if (flags & WC_CHAR) {
+    its.chars->setText(text);
+    its.chars->first();
+    std::size_t f = 0;
+    for (auto pos = its.chars->next(); pos != icu::BreakIterator::DONE;
+         pos = its.chars->next()) {
+      while (pos > bounds[f]) {
+        f += 1;
+      }
+      results[f].chars += 1;
+    }
+  }
+
+  for (std::size_t i = 0; i < items.size(); i += 1) {
+    report(items[i], results[i]);
+  }
+
+  raw.clear();
+  ends.clear();
+  items.clear();
 }
 
 void print_usage(const char *progname) {
@@ -219,8 +1129,28 @@ given.
 Other options:
 
   -j, --json : print out an array of JSON objects instead.
+  -J, --ndjson : print out one JSON object per line as each file is
+                 counted, followed by a totals object.
+  -r, --recursive : count every regular file in directories given as
+                    FILEs and their subdirectories.
+  --files0-from=F : read NUL-terminated file names from F (- for
+                    standard input) instead of the command line.
+  --group-by=dir|ext : also print counts for each top level
+                       subdirectory, or for each file extension.
+                       Files named as arguments are grouped by the
+                       directory they're in.
+  -t, --threads=N : walk directories and count files with N threads.
+                    Defaults to the number of CPUs.
+  --estimate=CONFIDENCE : estimate the counts of regular files by
+                          sampling them, and print the confidence
+                          intervals at the given level (e.g. 0.95).
+  --time-limit=SECONDS : stop sampling a file after SECONDS even if the
+                         intervals aren't yet within 1% (Default 10).
   -v, --version : print out version and exit.
   -h, --help : print out usage information and exit.
+
+With --recursive, --files0-from or --group-by, files are counted in
+parallel, largest first, and printed in the order they finish.
 )";
 }
 
@@ -233,12 +1163,24 @@ int main(int argc, char **argv) {
                           {"words", 0, nullptr, 'w'},
                           {"max-line-length", 0, nullptr, 'L'},
                           {"json", 0, nullptr, 'j'},
+                          {"ndjson", 0, nullptr, 'J'},
+                          {"recursive", 0, nullptr, 'r'},
+                          {"threads", 1, nullptr, 't'},
+                          {"files0-from", 1, nullptr, 1},
+                          {"group-by", 1, nullptr, 2},
+                          {"estimate", 1, nullptr, 3},
+                          {"time-limit", 1, nullptr, 4},
                           {nullptr, 0, nullptr, 0}};
   unsigned int flags = 0;
-  bool as_json = false;
+  auto mode = output::TEXT;
+  bool recursive = false;
+  const char *files0_from = nullptr;
+  auto by = grouping::NONE;
+  estimate_options est;
+  unsigned int nthreads = std::max(std::thread::hardware_concurrency(), 1U);
 
   for (int val;
-       (val = getopt_long(argc, argv, "vhcmlwLj", opts, nullptr)) != -1;) {
+       (val = getopt_long(argc, argv, "vhcmlwLjJrt:", opts, nullptr)) != -1;) {
     switch (val) {
     case 'v':
       std::cout << argv[0] << " version " << version << '\n';
@@ -262,7 +1204,54 @@ int main(int argc, char **argv) {
       flags |= WC_LEN;
       break;
     case 'j':
-      as_json = true;
+      mode = output::JSON;
+      break;
+    case 'J':
+      mode = output::NDJSON;
+      break;
+    case 'r':
+      recursive = true;
+      break;
+    case 't':
+      nthreads = std::strtoul(optarg, nullptr, 10);
+      if (nthreads == 0) {
+        std::cerr << argv[0] << ": invalid number of threads '" << optarg
+                  << "'\n";
+        return 1;
+      }
+      break;
+    case 1:
+      files0_from = optarg;
+      break;
+    case 2:
+      if (std::strcmp(optarg, "dir") == 0) {
+        by = grouping::DIR;
+      } else if (std::strcmp(optarg, "ext") == 0) {
+        by = grouping::EXT;
+      } else {
+        std::cerr << argv[0] << ": unknown grouping '" << optarg << "'\n";
+        return 1;
+      }
+      break;
+    case 3: {
+      char *end;
+      est.confidence = std::strtod(optarg, &end);
+      if (*end == '%' || est.confidence >= 1) {
+        est.confidence /= 100;
+      }
+      if (end == optarg || est.confidence <= 0 || est.confidence >= 1) {
+        std::cerr << argv[0] << ": invalid confidence level '" << optarg
+                  << "'\n";
+        return 1;
+      }
+      break;
+    }
+    case 4:
+      est.time_limit = std::strtod(optarg, nullptr);
+      if (est.time_limit <= 0) {
+        std::cerr << argv[0] << ": invalid time limit '" << optarg << "'\n";
+        return 1;
+      }
       break;
     default:
       return 1;
@@ -273,55 +1262,250 @@ int main(int argc, char **argv) {
     flags = WC_CHAR | WC_WORD | WC_NL;
   }
 
-  if (!as_json) {
-    flags |= WC_PRINT;
+  if (files0_from && optind != argc) {
+    std::cerr << argv[0]
+              << ": file operands cannot be combined with --files0-from\n";
+    return 1;
   }
 
   try {
     struct counts total_counts(flags);
-    int nfiles = 0;
+    std::uint64_t nfiles = 0;
     icu::Locale loc;
     nlohmann::json results;
+    std::map<std::string, struct counts> groups;
+
+    // Returns false if the file can't be opened.
+    auto count_file = [&](const char *filename, iterators &its,
+                          struct counts &c) {
+      if (est.confidence > 0 && estimate(filename, flags, its, est, c)) {
+        return true;
+      }
+      ufp uf = open_input(filename);
+      if (!uf) {
+        return false;
+      }
+      c = count(uf.get(), flags, its);
+      return true;
+    };
 
-    if (optind == argc) {
-      ufp ustdin{u_fadopt(stdin, nullptr, nullptr), &u_fclose};
+    auto report = [&](const char *filename, const struct counts &c) {
+      switch (mode) {
+      case output::TEXT:
+        std::cout << c;
+        if (filename) {
+          std::cout << '\t' << filename;
+        }
+        std::cout << '\n';
+        break;
+      case output::JSON:
+        results.push_back(counts_to_json(filename, c));
+        break;
+      case output::NDJSON:
+        print_ndjson(std::cout, filename, c);
+        break;
+      }
+    };
+
+    auto tally = [&](const work_item &w, const struct counts &c) {
+      report(w.path.c_str(), c);
+      total_counts += c;
+      nfiles += 1;
+      if (by != grouping::NONE) {
+        groups.emplace(w.group, counts(flags)).first->second += c;
+      }
+    };
+
+    if (optind == argc && !files0_from) {
+      ufp ustdin = open_stdin();
       if (!ustdin) {
         throw std::runtime_error{"Unable to read from standard input"};
       }
-      auto res = count(ustdin.get(), nullptr, flags, total_counts, loc);
-      if (as_json) {
-        results.push_back(res);
-      }
+      iterators its(flags, loc);
+      auto c = count(ustdin.get(), flags, its);
+      report(nullptr, c);
+      total_counts += c;
       nfiles += 1;
-    } else {
+    } else if (!recursive && !files0_from && by == grouping::NONE) {
+      iterators its(flags, loc);
+      batch pending;
       for (int i = optind; i < argc; i += 1) {
+        work_item w{argv[i], 0, ""s};
+        if (pending.add(w)) {
+          if (pending.full()) {
+            pending.count(flags, its, tally);
+          }
+          continue;
+        }
+        // Keep the output in command line order.
+        pending.count(flags, its, tally);
         try {
-          ufp uf = std::move([&]() {
-            if (std::strcmp(argv[i], "/dev/stdin") == 0 ||
-                std::strcmp(argv[i], "-") == 0) {
-              return ufp{u_fadopt(stdin, nullptr, nullptr), &u_fclose};
-            } else {
-              return ufp{u_fopen(argv[i], "r", nullptr, nullptr), &u_fclose};
-            }
-          }());
-          if (!uf) {
+          struct counts c(flags);
+          if (!count_file(argv[i], its, c)) {
             throw std::invalid_argument{argv[i]};
           }
-          auto res = count(uf.get(), argv[i], flags, total_counts, loc);
-          if (as_json) {
-            results.push_back(res);
-          }
-          nfiles += 1;
+          tally(w, c);
         } catch (std::invalid_argument &) {
           std::cerr << argv[0] << ": unable to open '" << argv[i] << "'\n";
         }
       }
+      pending.count(flags, its, tally);
+    } else {
+      work_queue queue;
+      std::mutex out_mtx;
+      std::exception_ptr failure;
+
+      auto error = [&](const std::string &msg) {
+        std::lock_guard<std::mutex> lock(out_mtx);
+        std::cerr << argv[0] << ": " << msg << '\n';
+      };
+
+      auto locked_tally = [&](const work_item &w, const struct counts &c) {
+        std::lock_guard<std::mutex> lock(out_mtx);
+        tally(w, c);
+      };
+
+      auto worker = [&]() {
+        try {
+          iterators its(flags, loc);
+          batch pending;
+          work_item w;
+          for (work_queue::task t;
+               (t = queue.pop(w)) != work_queue::task::DONE;) {
+            if (t == work_queue::task::DIR) {
+              try {
+                walk_directory(w, queue, by, error);
+              } catch (...) {
+                queue.done_producing();
+                throw;
+              }
+              queue.done_producing();
+              continue;
+            }
+            if (pending.add(w)) {
+              if (pending.full()) {
+                pending.count(flags, its, locked_tally);
+              }
+              continue;
+            }
+            struct counts c(flags);
+            if (!count_file(w.path.c_str(), its, c)) {
+              error("unable to open '"s + w.path + "'");
+              continue;
+            }
+            locked_tally(w, c);
+          }
+          pending.count(flags, its, locked_tally);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(out_mtx);
+          if (!failure) {
+            failure = std::current_exception();
+          }
+        }
+      };
+
+      // The main thread queues up the command line arguments while the
+      // workers are already walking and counting.
+      auto add = [&](const std::string &name) {
+        bool is_stdin = name == "-" || name == "/dev/stdin";
+        // A file named on the command line is grouped with the other
+        // files in its directory, like those found walking it.
+        std::string group;
+        if (by == grouping::DIR) {
+          group = is_stdin ? name : dir_group(name);
+        } else if (by == grouping::EXT) {
+          group = extension_group(name);
+        }
+        if (is_stdin) {
+          queue.push_file({name, 0, std::move(group)});
+          return;
+        }
+        struct stat st;
+        if (stat(name.c_str(), &st) < 0) {
+          error("unable to open '"s + name + "'");
+        } else if (!S_ISDIR(st.st_mode)) {
+          queue.push_file({name, st.st_size, std::move(group)});
+        } else if (recursive) {
+          queue.push_dir({name, 0, ""s});
+        } else {
+          error("'"s + name + "' is a directory");
+        }
+      };
+
+      queue.start_producing();
+      std::vector<std::thread> threads;
+      for (unsigned int n = 0; n < nthreads; n += 1) {
+        threads.emplace_back(worker);
+      }
+
+      try {
+        if (files0_from) {
+          std::ifstream names_file;
+          bool using_stdin = std::strcmp(files0_from, "-") == 0;
+          if (!using_stdin) {
+            names_file.open(files0_from);
+            if (!names_file.is_open()) {
+              throw std::runtime_error{"unable to open '"s + files0_from +
+                                       "'"};
+            }
+          }
+          std::istream &names = using_stdin ? std::cin : names_file;
+          std::string name;
+          while (std::getline(names, name, '\0')) {
+            if (name.empty()) {
+              error("invalid zero-length file name in '"s + files0_from + "'");
+            } else {
+              add(name);
+            }
+          }
+        } else {
+          for (int i = optind; i < argc; i += 1) {
+            add(argv[i]);
+          }
+        }
+      } catch (...) {
+        queue.done_producing();
+        for (auto &t : threads) {
+          t.join();
+        }
+        throw;
+      }
+
+      queue.done_producing();
+      for (auto &t : threads) {
+        t.join();
+      }
+      if (failure) {
+        std::rethrow_exception(failure);
+      }
     }
-    if (as_json) {
-      std::cout << results << '\n';
+
+    for (const auto &g : groups) {
+      switch (mode) {
+      case output::TEXT:
+        std::cout << g.second << '\t' << g.first << '\n';
+        break;
+      case output::JSON:
+        results.push_back(counts_to_json(g.first.c_str(), g.second, "group"));
+        break;
+      case output::NDJSON:
+        print_ndjson(std::cout, g.first.c_str(), g.second, "group");
+        break;
+      }
     }
-    if (nfiles > 1 && !as_json) {
-      std::cout << total_counts << "\ttotal\n";
+
+    switch (mode) {
+    case output::TEXT:
+      if (nfiles > 1) {
+        std::cout << total_counts << "\ttotal\n";
+      }
+      break;
+    case output::JSON:
+      std::cout << results << '\n';
+      break;
+    case output::NDJSON:
+      print_ndjson_total(std::cout, nfiles, total_counts);
+      break;
     }
   } catch (std::exception &e) {
     std::cerr << argv[0] << ": " << e.what() << '\n';